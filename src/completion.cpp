@@ -0,0 +1,932 @@
+#include "completion.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <climits>
+#include <numeric>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+// Letters share a bit regardless of case, digits share one, and everything
+// that is not ASCII lands in the last one
+constexpr auto char_bit(char c) -> std::uint32_t {
+  if (c >= 'a' && c <= 'z') {
+    return 1u << (c - 'a');
+  }
+  if (c >= 'A' && c <= 'Z') {
+    return 1u << (c - 'A');
+  }
+  if (c >= '0' && c <= '9') {
+    return 1u << 26;
+  }
+  if (c == '_') {
+    return 1u << 27;
+  }
+  return 1u << 28;
+}
+
+constexpr auto is_upper(char c) -> bool { return c >= 'A' && c <= 'Z'; }
+
+constexpr auto is_decimal(char c) -> bool { return c >= '0' && c <= '9'; }
+
+constexpr auto fold(char c) -> char {
+  return is_upper(c) ? static_cast<char>(c + ('a' - 'A')) : c;
+}
+
+// Words start after an underscore, at a lower to upper case change and where
+// letters and digits meet: get_value, getValue, vec3
+auto is_word_start(std::string_view value, std::size_t index) -> bool {
+  if (index == 0) {
+    return true;
+  }
+  auto previous = value[index - 1];
+  auto current = value[index];
+  if (current == '_') {
+    return false;
+  }
+  if (previous == '_') {
+    return true;
+  }
+  if (is_upper(current) && !is_upper(previous)) {
+    return true;
+  }
+  return is_decimal(current) != is_decimal(previous);
+}
+
+constexpr int unmatched = INT_MIN / 2;
+constexpr int word_start_bonus = 8;
+constexpr int first_character_bonus = 4;
+constexpr int consecutive_bonus = 6;
+constexpr int exact_case_bonus = 1;
+constexpr int gap_penalty = 1;
+constexpr int max_leading_penalty = 3;
+
+// Adjacent characters, case folded, spread over one of `bits` by Fibonacci
+// hashing, as the bits of nearby characters would otherwise collide. Each
+// pair takes a bit by each of two multipliers, so two pairs rarely share both.
+constexpr std::array<std::uint32_t, 2> pair_multipliers{0x9e3779b1u,
+                                                        0x85ebca77u};
+constexpr auto pair_hash(char previous, char current, std::size_t which,
+                         std::size_t bits) -> std::size_t {
+  auto pair = static_cast<std::uint32_t>(static_cast<unsigned char>(fold(previous)))
+                  << 8 |
+              static_cast<unsigned char>(fold(current));
+  return (pair * pair_multipliers[which]) >> (32 - std::countr_zero(bits));
+}
+
+constexpr auto bucket_of(char c) -> std::size_t {
+  return static_cast<unsigned char>(fold(c));
+}
+
+constexpr auto class_of(char c) -> std::size_t {
+  return static_cast<std::size_t>(std::countr_zero(char_bit(c)));
+}
+
+// Prefer shorter candidates when everything else is equal
+constexpr auto length_penalty(std::size_t candidate, std::size_t query)
+    -> int {
+  return static_cast<int>(candidate - query) / 8;
+}
+
+// Keys are bounds less the length penalty plus this, so none is negative and
+// zero is left for entries that cannot match. Longer queries could bound past
+// a byte, so all their entries share the highest key.
+constexpr int key_offset = 32;
+constexpr std::size_t max_keyed_query = 14;
+
+// A byte for each of several entries side by side, 16 at a time with SSE2
+// and one at a time otherwise, with arithmetic that saturates
+#if defined(__SSE2__)
+using Lanes = __m128i;
+constexpr std::size_t lane_count = 16;
+
+auto splat(int value) -> Lanes {
+  return _mm_set1_epi8(static_cast<char>(value));
+}
+auto load(std::uint8_t const *bytes) -> Lanes {
+  return _mm_loadu_si128(reinterpret_cast<__m128i const *>(bytes));
+}
+auto store(std::uint8_t *bytes, Lanes lanes) -> void {
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(bytes), lanes);
+}
+// All ones in each lane whose bit is set
+auto spread(std::uint64_t bits) -> Lanes {
+  // The low byte of the bits into the first eight lanes and the high byte
+  // into the last eight, then each lane keeps its own bit
+  auto bytes = _mm_cvtsi32_si128(static_cast<int>(bits & 0xffff));
+  bytes = _mm_unpacklo_epi8(bytes, bytes);
+  bytes = _mm_unpacklo_epi16(bytes, bytes);
+  bytes = _mm_unpacklo_epi32(bytes, bytes);
+  auto const select = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8,
+                                    16, 32, 64, -128);
+  return _mm_cmpeq_epi8(_mm_and_si128(bytes, select), select);
+}
+auto plus(Lanes a, Lanes b) -> Lanes { return _mm_adds_epu8(a, b); }
+auto minus(Lanes a, Lanes b) -> Lanes { return _mm_subs_epu8(a, b); }
+auto larger(Lanes a, Lanes b) -> Lanes { return _mm_max_epu8(a, b); }
+auto smaller(Lanes a, Lanes b) -> Lanes { return _mm_min_epu8(a, b); }
+auto both(Lanes a, Lanes b) -> Lanes { return _mm_and_si128(a, b); }
+auto equal(Lanes a, Lanes b) -> Lanes { return _mm_cmpeq_epi8(a, b); }
+// `a` where `mask` is set and `b` elsewhere
+auto choose(Lanes mask, Lanes a, Lanes b) -> Lanes {
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+// Zero where `mask` is set and `a` elsewhere
+auto unless(Lanes mask, Lanes a) -> Lanes { return _mm_andnot_si128(mask, a); }
+// Bytes have no shift, but the bits shifted in from the next byte are masked
+// off
+auto eighth(Lanes a) -> Lanes {
+  return _mm_and_si128(_mm_srli_epi16(a, 3), splat(0x1f));
+}
+auto highest(Lanes a) -> int {
+  a = _mm_max_epu8(a, _mm_srli_si128(a, 8));
+  a = _mm_max_epu8(a, _mm_srli_si128(a, 4));
+  a = _mm_max_epu8(a, _mm_srli_si128(a, 2));
+  a = _mm_max_epu8(a, _mm_srli_si128(a, 1));
+  return _mm_cvtsi128_si32(a) & 0xff;
+}
+// One bit per lane from `low` to `high`
+auto between(Lanes a, int low, int high) -> std::uint64_t {
+  auto inside = _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(a, splat(low)), a),
+                              _mm_cmpeq_epi8(_mm_min_epu8(a, splat(high)), a));
+  return static_cast<std::uint16_t>(_mm_movemask_epi8(inside));
+}
+auto prefetch(char const *address) -> void {
+  _mm_prefetch(address, _MM_HINT_T0);
+}
+#else
+using Lanes = std::uint8_t;
+constexpr std::size_t lane_count = 1;
+
+auto splat(int value) -> Lanes { return static_cast<Lanes>(value); }
+auto load(std::uint8_t const *bytes) -> Lanes { return *bytes; }
+auto store(std::uint8_t *bytes, Lanes lanes) -> void { *bytes = lanes; }
+auto spread(std::uint64_t bits) -> Lanes {
+  return (bits & 1) != 0 ? UINT8_MAX : 0;
+}
+auto plus(Lanes a, Lanes b) -> Lanes {
+  return static_cast<Lanes>(std::min(a + b, UINT8_MAX));
+}
+auto minus(Lanes a, Lanes b) -> Lanes {
+  return static_cast<Lanes>(std::max(a - b, 0));
+}
+auto larger(Lanes a, Lanes b) -> Lanes { return std::max(a, b); }
+auto smaller(Lanes a, Lanes b) -> Lanes { return std::min(a, b); }
+auto both(Lanes a, Lanes b) -> Lanes { return a & b; }
+auto equal(Lanes a, Lanes b) -> Lanes { return a == b ? UINT8_MAX : 0; }
+auto choose(Lanes mask, Lanes a, Lanes b) -> Lanes { return mask ? a : b; }
+auto unless(Lanes mask, Lanes a) -> Lanes { return mask ? 0 : a; }
+auto eighth(Lanes a) -> Lanes { return a / 8; }
+auto highest(Lanes a) -> int { return a; }
+auto between(Lanes a, int low, int high) -> std::uint64_t {
+  return a >= low && a <= high;
+}
+auto prefetch(char const *) -> void {}
+#endif
+} // namespace
+
+auto CompletionEngine::add(std::string_view identifier) -> void {
+  auto before = identifiers.size();
+  auto symbol = identifiers.intern(identifier);
+  if (symbol < before || identifier.empty()) {
+    return;
+  }
+  last_query.reset();
+  // The planes of the entry, the same in each bucket it goes to
+  std::vector<std::size_t> marked;
+  auto set = [&](std::size_t plane) { marked.push_back(plane); };
+
+  std::size_t last_word_start = 0;
+  std::size_t first_word = UINT8_MAX;
+  std::size_t shortest_word = UINT8_MAX;
+  char second{};
+  // Case folded, each character starting a later word other than the first
+  std::string later;
+  for (std::size_t i = 0; i < identifier.size(); i++) {
+    auto c = identifier[i];
+    set(contains_plane + class_of(c));
+    if (i == 0) {
+      continue;
+    }
+    auto word_start = is_word_start(identifier, i);
+    for (std::size_t which = 0; which < pair_multipliers.size(); which++) {
+      set(word_start ? word_start_pair_plane +
+                           pair_hash(identifier[i - 1], c, which,
+                                     word_start_pair_bits)
+                     : pair_plane +
+                           pair_hash(identifier[i - 1], c, which, pair_bits));
+      if (!word_start && first_word == UINT8_MAX) {
+        set(first_word_pair_plane + pair_hash(identifier[i - 1], c, which,
+                                              first_word_pair_bits));
+      }
+    }
+    if (word_start) {
+      set((is_upper(c) ? upper_word_start_plane : lower_word_start_plane) +
+          class_of(c));
+      if (first_word == UINT8_MAX) {
+        first_word = i;
+        second = fold(c);
+      }
+      shortest_word = std::min(shortest_word, i - last_word_start);
+      last_word_start = i;
+      if (fold(c) != fold(identifier.front()) &&
+          later.find(fold(c)) == std::string::npos) {
+        later += fold(c);
+      }
+    }
+  }
+  if (is_upper(identifier.front())) {
+    set(upper_first_plane);
+  }
+
+  auto length = std::min<std::size_t>(identifier.size(), UINT8_MAX);
+  auto place = [&](Bucket &bucket) {
+    if (bucket.planes.empty()) {
+      bucket.planes.resize(plane_count);
+    }
+    auto entry = bucket.symbols.size();
+    if (entry % 64 == 0) {
+      for (auto &plane : bucket.planes) {
+        plane.push_back(0);
+      }
+      for (auto *bytes : {&bucket.lengths, &bucket.first_words,
+                          &bucket.shortest_words, &bucket.seconds}) {
+        bytes->resize(entry + 64);
+      }
+    }
+    for (auto plane : marked) {
+      bucket.planes[plane][entry / 64] |= std::uint64_t{1} << (entry % 64);
+    }
+    bucket.symbols.push_back(symbol);
+    bucket.texts.push_back(static_cast<std::uint32_t>(characters.size()));
+    bucket.lengths[entry] = static_cast<std::uint8_t>(length);
+    bucket.first_words[entry] = static_cast<std::uint8_t>(first_word);
+    bucket.shortest_words[entry] = static_cast<std::uint8_t>(shortest_word);
+    bucket.seconds[entry] = static_cast<std::uint8_t>(second);
+    return entry;
+  };
+  auto &bucket = buckets[bucket_of(identifier.front())];
+  auto entry = place(bucket);
+  if (bucket.by_length.size() <= length) {
+    bucket.by_length.resize(length + 1);
+  }
+  bucket.by_length[length].push_back(static_cast<std::uint32_t>(entry));
+  for (auto c : later) {
+    place(buckets[later_buckets + bucket_of(c)]);
+  }
+  characters += identifier;
+  offsets.push_back(static_cast<std::uint32_t>(characters.size()));
+}
+
+auto CompletionEngine::text(Symbol symbol) const -> std::string_view {
+  return {characters.data() + offsets[symbol],
+          offsets[symbol + 1] - offsets[symbol]};
+}
+
+auto CompletionEngine::add_identifiers(Lexer &lexer) -> void {
+  while (auto token = lexer.get_next_token()) {
+    if (auto *identifier = std::get_if<Identifier>(&*token)) {
+      add(identifier->value);
+    }
+  }
+}
+
+auto CompletionEngine::size() const -> std::size_t {
+  return identifiers.size();
+}
+
+auto CompletionEngine::complete(std::string_view query, std::size_t limit)
+    -> std::vector<CompletionItem> {
+  return complete(query, limit, Progress{});
+}
+
+auto CompletionEngine::complete(std::string_view query, std::size_t limit,
+                                Progress const &on_batch,
+                                std::size_t batch_size)
+    -> std::vector<CompletionItem> {
+  if (query.empty() || limit == 0) {
+    return {};
+  }
+  auto own = bucket_of(query.front());
+  // What each query character looks for in a candidate: its class at a word
+  // start, in its case or either, and after the first the pair it makes with
+  // the previous one
+  struct Step {
+    std::size_t character_class;
+    bool upper;
+    std::array<std::size_t, 2> pairs;
+    std::array<std::size_t, 2> word_start_pairs;
+    std::array<std::size_t, 2> first_word_pairs;
+  };
+  std::vector<Step> steps(query.size());
+  std::uint32_t query_mask{};
+  for (std::size_t i = 0; i < query.size(); i++) {
+    auto &step = steps[i];
+    step.character_class = class_of(query[i]);
+    step.upper = is_upper(query[i]);
+    for (std::size_t which = 0; i > 0 && which < pair_multipliers.size();
+         which++) {
+      step.pairs[which] = pair_hash(query[i - 1], query[i], which, pair_bits);
+      step.word_start_pairs[which] =
+          pair_hash(query[i - 1], query[i], which, word_start_pair_bits);
+      step.first_word_pairs[which] =
+          pair_hash(query[i - 1], query[i], which, first_word_pair_bits);
+    }
+    query_mask |= char_bit(query[i]);
+  }
+  struct Ranked {
+    int score;
+    Symbol symbol;
+  };
+  auto better = [&](Ranked const &first, Ranked const &second) {
+    if (first.score != second.score) {
+      return first.score > second.score;
+    }
+    auto first_name = text(first.symbol);
+    auto second_name = text(second.symbol);
+    if (first_name.size() != second_name.size()) {
+      return first_name.size() < second_name.size();
+    }
+    return first_name < second_name;
+  };
+  // Heap of the best `limit` matches with the worst of them on top
+  std::vector<Ranked> best;
+  auto full = [&]() { return best.size() == limit; };
+  // Whether nothing with this score after the length penalty and at least
+  // this length can make the list
+  auto beyond = [&](int key, std::size_t length) {
+    if (!full()) {
+      return false;
+    }
+    auto worst = best.front();
+    return key < worst.score ||
+           (key == worst.score && length > text(worst.symbol).size());
+  };
+  auto insert = [&](Ranked candidate) {
+    if (!full()) {
+      best.push_back(candidate);
+      std::push_heap(best.begin(), best.end(), better);
+    } else if (better(candidate, best.front())) {
+      std::pop_heap(best.begin(), best.end(), better);
+      best.back() = candidate;
+      std::push_heap(best.begin(), best.end(), better);
+    }
+  };
+  auto ranked = [&]() {
+    auto sorted = best;
+    std::sort(sorted.begin(), sorted.end(), better);
+    std::vector<CompletionItem> items;
+    items.reserve(sorted.size());
+    for (auto [score, symbol] : sorted) {
+      items.push_back({identifiers.name(symbol), score});
+    }
+    return items;
+  };
+
+  if (query.size() == 1) {
+    // A single character scores the same in every candidate starting with
+    // it, give or take exact case, and more than where it starts a later
+    // word. So the shortest of those are the best, unless there are too few
+    // of them to fill the list with scores no later word start can reach.
+    auto const &bucket = buckets[own];
+    std::size_t walked = 0;
+    for (std::size_t length = 1; length < bucket.by_length.size(); length++) {
+      if (beyond(word_start_bonus + first_character_bonus + exact_case_bonus -
+                     length_penalty(length, 1),
+                 length)) {
+        break;
+      }
+      for (auto entry : bucket.by_length[length]) {
+        auto symbol = bucket.symbols[entry];
+        auto name = text(symbol);
+        insert({word_start_bonus + first_character_bonus +
+                    (name.front() == query.front() ? exact_case_bonus : 0) -
+                    length_penalty(name.size(), 1),
+                symbol});
+        if (++walked % batch_size == 0 && on_batch && !on_batch(ranked())) {
+          return ranked();
+        }
+      }
+    }
+    if (full() && best.front().score > word_start_bonus + exact_case_bonus - 1) {
+      return ranked();
+    }
+    best.clear();
+  }
+
+  // Otherwise every candidate gets a key, the most it can score less the
+  // length penalty, worked out for a lane of entries at once from the planes
+  // of the query's characters. The best score so far is bounded three ways:
+  // with the query so far within the first word from the first character
+  // on, which only pays for the characters it skips when leaving that word;
+  // with its last character at a later word start, where the next one is at
+  // least the shortest word away; and with it anywhere else. Unmatched is
+  // zero, which only loosens a bound.
+  //
+  // Working that out for every entry would take longer than scoring the few
+  // that make the list, so each word of 64 entries first gets a rough bound
+  // on its keys from what any of them can gain per character, and only
+  // words whose bound the heap does not rule out are worked out, as far as
+  // the query goes. A narrowed query goes on from there.
+  static_assert(exact_case_bonus == gap_penalty && gap_penalty == 1);
+  auto keyed = query.size() <= max_keyed_query;
+  auto narrowed =
+      keyed && last_query.has_value() && query.starts_with(*last_query);
+  auto from = narrowed ? last_query->size() : 0;
+  last_query.reset();
+  if (!narrowed) {
+    words.clear();
+  }
+
+  struct Planes {
+    std::uint64_t const *lower;
+    std::uint64_t const *upper;
+    std::array<std::uint64_t const *, 2> pairs;
+    std::array<std::uint64_t const *, 2> word_start_pairs;
+    std::array<std::uint64_t const *, 2> first_word_pairs;
+  };
+  // Looked up per bucket the first time a word of it comes up, as words
+  // come up in order of their bounds
+  std::vector<std::vector<Planes>> bucket_planes(buckets.size());
+  std::vector<std::vector<std::uint64_t const *>> bucket_contained(
+      buckets.size());
+  Planes const *planes{};
+  std::vector<std::uint64_t const *> const *contained{};
+  auto use_planes = [&](std::size_t index) {
+    auto &found = bucket_planes[index];
+    if (found.empty()) {
+      auto const &bucket = buckets[index];
+      found.resize(steps.size());
+      for (std::size_t i = 0; i < steps.size(); i++) {
+        auto const &step = steps[i];
+        auto &at = found[i];
+        at.lower =
+            bucket.planes[lower_word_start_plane + step.character_class].data();
+        at.upper =
+            bucket.planes[upper_word_start_plane + step.character_class].data();
+        for (std::size_t which = 0; which < pair_multipliers.size();
+             which++) {
+          at.pairs[which] =
+              bucket.planes[pair_plane + step.pairs[which]].data();
+          at.word_start_pairs[which] =
+              bucket
+                  .planes[word_start_pair_plane + step.word_start_pairs[which]]
+                  .data();
+          at.first_word_pairs[which] =
+              bucket
+                  .planes[first_word_pair_plane + step.first_word_pairs[which]]
+                  .data();
+        }
+      }
+      for (auto mask = query_mask; mask != 0; mask &= mask - 1) {
+        bucket_contained[index].push_back(
+            bucket.planes[contains_plane + std::countr_zero(mask)].data());
+      }
+    }
+    planes = found.data();
+    contained = &bucket_contained[index];
+  };
+
+  // The most the best bound of each entry in a lane can gain at step `i`,
+  // the length penalty aside: at a word start after a word start pair, at
+  // any other word start, after a pair, or just for exact case
+  auto gain = [&](std::size_t i, std::size_t index, std::size_t lane) {
+    auto const &step = planes[i];
+    auto word_start_pair =
+        step.word_start_pairs[0][index] & step.word_start_pairs[1][index];
+    auto word_start = step.lower[index] | step.upper[index];
+    auto pair = (step.pairs[0][index] & step.pairs[1][index]) |
+                (step.first_word_pairs[0][index] &
+                 step.first_word_pairs[1][index]);
+    return larger(
+        larger(both(spread(word_start_pair >> lane),
+                    splat(word_start_bonus + exact_case_bonus +
+                          consecutive_bonus)),
+               both(spread(word_start >> lane),
+                    splat(word_start_bonus + exact_case_bonus))),
+        larger(both(spread(pair >> lane),
+                    splat(exact_case_bonus + consecutive_bonus)),
+               splat(exact_case_bonus)));
+  };
+  auto word_start_score = [&](std::uint64_t exact) {
+    return plus(splat(word_start_bonus),
+                both(spread(exact), splat(exact_case_bonus)));
+  };
+  // Takes the state of `word` through the query up to `until` and bounds its
+  // keys by what the rest can gain, so they are exact at the end
+  auto advance = [&](Word &word, std::size_t until) {
+    auto &state = states[word.state];
+    if (!keyed) {
+      for (std::size_t i = 0; i < 64; i++) {
+        state.keys[i] = (word.alive >> i & 1) != 0 ? UINT8_MAX : 0;
+      }
+      word.steps = static_cast<std::uint32_t>(steps.size());
+      word.bound = UINT8_MAX;
+      return;
+    }
+    use_planes(word.bucket);
+    auto const &bucket = buckets[word.bucket];
+    auto leading = word.bucket == own;
+    auto index = word.index;
+    auto same_case = [&](std::size_t i) {
+      return (steps[i].upper ? planes[i].upper : planes[i].lower)[index];
+    };
+    auto top = splat(0);
+    auto none = splat(0);
+    for (std::size_t lane = 0; lane < 64; lane += lane_count) {
+      auto entry = index * 64 + lane;
+      auto first_word = load(bucket.first_words.data() + entry);
+      auto shortest_word = load(bucket.shortest_words.data() + entry);
+      auto skipped = larger(minus(shortest_word, splat(1)), splat(1));
+      auto inside = leading ? load(state.inside.data() + lane) : none;
+      auto at_word_start = load(state.at_word_start.data() + lane);
+      auto elsewhere = load(state.elsewhere.data() + lane);
+      if (word.steps == 0) {
+        inside = none;
+        if (leading) {
+          auto upper_first = bucket.planes[upper_first_plane][index] >> lane;
+          inside =
+              plus(splat(word_start_bonus + first_character_bonus),
+                   both(spread(steps[0].upper ? upper_first : ~upper_first),
+                        splat(exact_case_bonus)));
+        }
+        // At the second word start at the earliest
+        at_word_start = both(
+            spread((planes[0].lower[index] | planes[0].upper[index]) >> lane),
+            minus(word_start_score(same_case(0) >> lane),
+                  smaller(first_word, splat(max_leading_penalty))));
+        elsewhere = none;
+      }
+      for (auto i = std::max<std::size_t>(word.steps, 1); i < until; i++) {
+        auto const &step = planes[i];
+        auto score_at = word_start_score(same_case(i) >> lane);
+        auto pair =
+            spread((step.pairs[0][index] & step.pairs[1][index]) >> lane);
+        auto word_start_pair = spread((step.word_start_pairs[0][index] &
+                                       step.word_start_pairs[1][index]) >>
+                                      lane);
+        auto best = larger(at_word_start, elsewhere);
+        auto next_word_start =
+            choose(word_start_pair,
+                   plus(best, plus(score_at, splat(consecutive_bonus))),
+                   plus(larger(minus(at_word_start, skipped),
+                               minus(elsewhere, splat(gap_penalty))),
+                        score_at));
+        auto next_elsewhere = plus(
+            best, both(pair, splat(exact_case_bonus + consecutive_bonus)));
+        // Only entries of the own bucket can still be in their first word
+        if (leading) {
+          // Leaving the first word skips every character of it that is not
+          // matched, up to the second word start if that is this character
+          // and the third otherwise, or past the second word start
+          auto second = load(bucket.seconds.data() + entry);
+          auto target = choose(equal(second, splat(fold(query[i]))),
+                               first_word, plus(first_word, shortest_word));
+          next_word_start = larger(
+              next_word_start,
+              unless(equal(inside, none),
+                     plus(minus(inside,
+                                minus(target, splat(static_cast<int>(i)))),
+                          plus(score_at, both(word_start_pair,
+                                              splat(consecutive_bonus))))));
+          next_elsewhere = larger(
+              next_elsewhere,
+              unless(equal(inside, none),
+                     plus(minus(inside, minus(first_word,
+                                              splat(static_cast<int>(i) - 1))),
+                          splat(exact_case_bonus))));
+        }
+        at_word_start =
+            both(spread((step.lower[index] | step.upper[index]) >> lane),
+                 next_word_start);
+        elsewhere = next_elsewhere;
+        if (leading) {
+          auto first_word_pair = spread((step.first_word_pairs[0][index] &
+                                         step.first_word_pairs[1][index]) >>
+                                        lane);
+          inside = unless(
+              equal(minus(first_word, splat(static_cast<int>(i))), none),
+              plus(inside,
+                   plus(splat(exact_case_bonus),
+                        both(first_word_pair, splat(consecutive_bonus)))));
+        }
+      }
+      if (leading) {
+        store(state.inside.data() + lane, inside);
+      }
+      store(state.at_word_start.data() + lane, at_word_start);
+      store(state.elsewhere.data() + lane, elsewhere);
+      auto bound = larger(inside, larger(at_word_start, elsewhere));
+      for (auto i = until; i < steps.size(); i++) {
+        bound = plus(bound, gain(i, index, lane));
+      }
+      auto penalty = eighth(minus(load(bucket.lengths.data() + entry),
+                                  splat(static_cast<int>(query.size()))));
+      auto keys = both(plus(minus(bound, penalty), splat(key_offset)),
+                       spread(word.alive >> lane));
+      store(state.keys.data() + lane, keys);
+      top = larger(top, keys);
+    }
+    word.steps = static_cast<std::uint32_t>(until);
+    word.bound = highest(top);
+  };
+  // Bounds the keys of a carried word by what the characters typed since can
+  // gain, each of which takes the length penalty down by at most one
+  auto raise = [&](Word &word) {
+    use_planes(word.bucket);
+    auto &keys = states[word.state].keys;
+    auto top = splat(0);
+    for (std::size_t lane = 0; lane < 64; lane += lane_count) {
+      auto raised = load(keys.data() + lane);
+      for (auto i = from; i < steps.size(); i++) {
+        raised = plus(raised, plus(gain(i, word.index, lane), splat(1)));
+      }
+      raised = both(raised, spread(word.alive >> lane));
+      store(keys.data() + lane, raised);
+      top = larger(top, raised);
+    }
+    word.bound = highest(top);
+  };
+
+  // Scores the match unless its key shows it cannot make the list
+  auto consider = [&](Pending const &match) {
+    auto const &bucket = buckets[match.bucket];
+    auto name = match.length < UINT8_MAX
+                    ? std::string_view{characters.data() + match.text,
+                                       match.length}
+                    : text(bucket.symbols[match.entry]);
+    if (beyond(match.key, name.size())) {
+      return;
+    }
+    if (auto value = score(query, name)) {
+      insert({*value - length_penalty(name.size(), query.size()),
+              bucket.symbols[match.entry]});
+    }
+  };
+  // Scores the matches of the words in [begin, end) from the highest key
+  // down, so the heap fills with good matches early and most are never
+  // scored, until the rest cannot make the list. Words are taken the rest
+  // of the way in order of their bounds, only once a key they may have
+  // comes up, and their matches the heap does not rule out put by key.
+  auto select = [&](std::size_t begin, std::size_t end, int highest_key) {
+    counts.assign(UINT8_MAX + 2, 0);
+    for (auto i = begin; i < end; i++) {
+      counts[UINT8_MAX - words[i].bound + 1]++;
+    }
+    std::partial_sum(counts.begin(), counts.end(), counts.begin());
+    by_bound.resize(end - begin);
+    for (auto i = begin; i < end; i++) {
+      by_bound[counts[UINT8_MAX - words[i].bound]++] =
+          static_cast<std::uint32_t>(i);
+    }
+    for (auto &matches : by_key) {
+      matches.clear();
+    }
+    auto reached = by_bound.begin();
+    for (auto key = highest_key; key > 0; key--) {
+      if (beyond(key - key_offset, 0)) {
+        return;
+      }
+      for (; reached != by_bound.end() && words[*reached].bound >= key;
+           ++reached) {
+        auto &word = words[*reached];
+        if (word.steps < steps.size()) {
+          advance(word, steps.size());
+        }
+        auto const &bucket = buckets[word.bucket];
+        auto const &keys = states[word.state].keys;
+        auto lowest = full() ? best.front().score + key_offset : 1;
+        std::uint64_t bits{};
+        for (std::size_t lane = 0; lane < 64; lane += lane_count) {
+          bits |= between(load(keys.data() + lane), lowest, key) << lane;
+        }
+        for (; bits != 0; bits &= bits - 1) {
+          auto bit = static_cast<std::size_t>(std::countr_zero(bits));
+          auto entry = word.index * 64 + bit;
+          by_key[keys[bit]].push_back(
+              {keys[bit] - key_offset, bucket.lengths[entry], word.bucket,
+               static_cast<std::uint32_t>(entry), bucket.texts[entry]});
+        }
+      }
+      // Many matches share a key, and only the shortest of them tend to be
+      // scored, so they are put in order by counting
+      auto const &matches = by_key[key];
+      counts.assign(UINT8_MAX + 2, 0);
+      for (auto const &match : matches) {
+        counts[match.length + 1]++;
+      }
+      std::partial_sum(counts.begin(), counts.end(), counts.begin());
+      ordered.resize(matches.size());
+      for (auto const &match : matches) {
+        ordered[counts[match.length]++] = match;
+      }
+      // Their names are all over memory, so each is fetched a few ahead
+      constexpr std::size_t ahead = 8;
+      for (std::size_t i = 0; i < ahead && i < ordered.size(); i++) {
+        prefetch(characters.data() + ordered[i].text);
+      }
+      for (std::size_t i = 0; i < ordered.size(); i++) {
+        if (beyond(ordered[i].key, ordered[i].length)) {
+          break;
+        }
+        if (i + ahead < ordered.size()) {
+          prefetch(characters.data() + ordered[i + ahead].text);
+        }
+        consider(ordered[i]);
+      }
+    }
+  };
+
+  // A narrowed query goes on from the words of the last one, dropping
+  // entries that lack a character class. Otherwise the candidates are those
+  // starting with the first character of the query, then those where it
+  // starts a later word, and only the first character has to be found at
+  // the start of a word.
+  std::size_t total{};
+  std::vector<std::size_t> order;
+  if (narrowed) {
+    total = words.size() * 64;
+  } else {
+    for (auto index : {own, later_buckets + own}) {
+      if (!buckets[index].symbols.empty()) {
+        order.push_back(index);
+        total += buckets[index].lengths.size();
+      }
+    }
+    states.resize(std::max(states.size(), total / 64));
+  }
+  std::size_t done = 0;
+  std::size_t batch = 0;
+  std::size_t batch_begin = 0;
+  auto highest_key = 0;
+  // Counts a word and once the batch is full, selects from it and tells
+  // whether to go on
+  auto next_word = [&](std::size_t end) {
+    done += 64;
+    batch += 64;
+    if (done < total && (!on_batch || batch < batch_size)) {
+      return true;
+    }
+    select(batch_begin, end, highest_key);
+    batch_begin = end;
+    highest_key = 0;
+    batch = 0;
+    return done == total || !on_batch || on_batch(ranked());
+  };
+  if (narrowed) {
+    std::size_t kept = 0;
+    for (std::size_t next = 0; next < words.size(); next++) {
+      auto word = words[next];
+      use_planes(word.bucket);
+      for (auto const *plane : *contained) {
+        word.alive &= plane[word.index];
+      }
+      if (word.alive != 0) {
+        // Without the first word to leave, taking a step costs about as much
+        // as bounding it
+        if (word.bucket == own) {
+          raise(word);
+        } else {
+          advance(word, steps.size());
+        }
+        highest_key = std::max(highest_key, word.bound);
+        words[kept++] = word;
+      }
+      if (!next_word(kept)) {
+        return ranked();
+      }
+    }
+    words.resize(kept);
+  } else {
+    for (auto index : order) {
+      auto const &bucket = buckets[index];
+      use_planes(index);
+      for (std::size_t word = 0; word < bucket.lengths.size() / 64; word++) {
+        auto alive = ~std::uint64_t{0};
+        for (auto const *plane : *contained) {
+          alive &= plane[word];
+        }
+        if (alive != 0) {
+          words.push_back({static_cast<std::uint32_t>(index),
+                           static_cast<std::uint32_t>(word), alive, 0, 0,
+                           static_cast<std::uint32_t>(words.size())});
+          advance(words.back(), keyed && index == own ? 1 : steps.size());
+          highest_key = std::max(highest_key, words.back().bound);
+        }
+        if (!next_word(words.size())) {
+          return ranked();
+        }
+      }
+    }
+  }
+  if (keyed) {
+    last_query = std::string{query};
+  }
+  return ranked();
+}
+
+auto CompletionEngine::score(std::string_view query,
+                             std::string_view candidate) -> std::optional<int> {
+  auto rows = query.size();
+  auto columns = candidate.size();
+  if (rows > columns) {
+    return {};
+  }
+
+  if (rows == 1) {
+    // Single characters are the most common query and match the most
+    // candidates, so skip the table for them
+    auto result = unmatched;
+    auto q = query.front();
+    for (std::size_t j = 0; j < columns; j++) {
+      auto c = candidate[j];
+      if (fold(q) != fold(c) || !is_word_start(candidate, j)) {
+        continue;
+      }
+      result = std::max(result,
+                        word_start_bonus + (q == c ? exact_case_bonus : 0) +
+                            (j == 0 ? first_character_bonus : 0) -
+                            std::min(static_cast<int>(j), max_leading_penalty));
+    }
+    if (result == unmatched) {
+      return {};
+    }
+    return result;
+  }
+
+  // Only word starts can take the first query character, so nothing left of
+  // the first one that matches needs a column
+  std::size_t offset = 0;
+  while (offset < columns && (fold(candidate[offset]) != fold(query.front()) ||
+                              !is_word_start(candidate, offset))) {
+    offset++;
+  }
+  if (offset + rows > columns) {
+    return {};
+  }
+  // Most candidates that get this far do not match at all, which one pass
+  // tells for much less than the table
+  std::size_t found = 1;
+  for (auto j = offset + 1; j < columns && found < rows; j++) {
+    found += fold(candidate[j]) == fold(query[found]) ? 1 : 0;
+  }
+  if (found < rows) {
+    return {};
+  }
+
+  // One column at a time, so each word start is found once. last_column[i]
+  // is the best score with query[i] matched at the previous column, and
+  // best_left[i] the best with it matched further left, less the gap up to
+  // the previous column.
+  last_column.assign(rows, unmatched);
+  best_left.assign(rows, unmatched);
+  auto result = unmatched;
+  for (auto j = offset; j < columns; j++) {
+    // Query character i can only match from column offset + i on and has to
+    // leave room for the rest of the query
+    auto matched = std::min(rows, j - offset + 1);
+    auto needed = rows - std::min(rows, columns - j);
+    for (auto i = needed > 0 ? needed - 1 : 0; i < matched; i++) {
+      best_left[i] =
+          std::max(best_left[i] == unmatched ? unmatched
+                                             : best_left[i] - gap_penalty,
+                   last_column[i]);
+    }
+    auto c = candidate[j];
+    auto start = is_word_start(candidate, j);
+    for (auto i = matched; i-- > needed;) {
+      auto q = query[i];
+      auto value = unmatched;
+      if (fold(q) == fold(c)) {
+        auto bonus = (start ? word_start_bonus : 0) +
+                     (q == c ? exact_case_bonus : 0);
+        if (i == 0) {
+          // Like most editors, the first character has to start a word
+          if (start) {
+            auto leading = static_cast<int>(j);
+            value = bonus + (leading == 0 ? first_character_bonus : 0) -
+                    std::min(leading, max_leading_penalty);
+          }
+        } else {
+          if (best_left[i - 1] != unmatched) {
+            value = best_left[i - 1] + bonus;
+          }
+          if (last_column[i - 1] != unmatched) {
+            value = std::max(value,
+                             last_column[i - 1] + bonus + consecutive_bonus);
+          }
+        }
+      }
+      last_column[i] = value;
+    }
+    result = std::max(result, last_column[rows - 1]);
+  }
+  if (result == unmatched) {
+    return {};
+  }
+  return result;
+}
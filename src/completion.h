@@ -0,0 +1,139 @@
+#pragma once
+
+#include <interner.h>
+#include <lexer.h>
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct CompletionItem {
+  std::string_view label;
+  int score;
+};
+
+// Ranks the identifiers seen in the open documents and the workspace against
+// what the user typed, by fuzzy subsequence match
+class CompletionEngine {
+public:
+  using Progress = std::function<bool(std::vector<CompletionItem> const &)>;
+
+  auto add(std::string_view identifier) -> void;
+  auto add_identifiers(Lexer &lexer) -> void;
+  auto size() const -> std::size_t;
+
+  auto complete(std::string_view query, std::size_t limit)
+      -> std::vector<CompletionItem>;
+  // Calls `on_batch` with the best items found so far after every
+  // `batch_size` candidates, and stops early once it returns false, e.g.
+  // because a newer keystroke arrived
+  auto complete(std::string_view query, std::size_t limit,
+                Progress const &on_batch, std::size_t batch_size = 1 << 16)
+      -> std::vector<CompletionItem>;
+
+private:
+  // Character classes, see char_bit, and hashed pairs of adjacent characters,
+  // see pair_hash
+  static constexpr std::size_t classes = 29;
+  static constexpr std::size_t pair_bits = 128;
+  static constexpr std::size_t word_start_pair_bits = 64;
+  static constexpr std::size_t first_word_pair_bits = 64;
+  // Each bucket keeps one bit per entry for each of these, 64 entries to a
+  // word, so a query reads only the planes of its own characters: the classes
+  // an identifier contains, those starting a word after the first character
+  // by case, the pairs where the second character does not start a word,
+  // those where it does and those within the first word, and whether the
+  // first character is upper case
+  static constexpr std::size_t contains_plane = 0;
+  static constexpr std::size_t lower_word_start_plane =
+      contains_plane + classes;
+  static constexpr std::size_t upper_word_start_plane =
+      lower_word_start_plane + classes;
+  static constexpr std::size_t pair_plane = upper_word_start_plane + classes;
+  static constexpr std::size_t word_start_pair_plane = pair_plane + pair_bits;
+  static constexpr std::size_t first_word_pair_plane =
+      word_start_pair_plane + word_start_pair_bits;
+  static constexpr std::size_t upper_first_plane =
+      first_word_pair_plane + first_word_pair_bits;
+  static constexpr std::size_t plane_count = upper_first_plane + 1;
+
+  // Identifiers by case folded first character, and again by that of each
+  // later word start where it differs. The first character of a query has to
+  // start a word, so a query reads only its own bucket of each kind.
+  struct Bucket {
+    std::vector<Symbol> symbols;
+    // Where the name of each entry starts in `characters`
+    std::vector<std::uint32_t> texts;
+    std::vector<std::vector<std::uint64_t>> planes;
+    // Per entry and padded with zeros to whole words, at most 255: the
+    // length, the characters before the second word start and the fewest
+    // from one word start to the next; and the case folded first character
+    // of the second word
+    std::vector<std::uint8_t> lengths;
+    std::vector<std::uint8_t> first_words;
+    std::vector<std::uint8_t> shortest_words;
+    std::vector<std::uint8_t> seconds;
+    // Entries by length, at most 255
+    std::vector<std::vector<std::uint32_t>> by_length;
+  };
+
+  // Before the length penalty, which depends only on the lengths
+  auto score(std::string_view query, std::string_view candidate)
+      -> std::optional<int>;
+
+  auto text(Symbol symbol) const -> std::string_view;
+
+  Interner identifiers;
+  static constexpr std::size_t later_buckets = 256;
+  std::vector<Bucket> buckets = std::vector<Bucket>(2 * later_buckets);
+  // Every identifier back to back, so scoring reads memory in order instead
+  // of chasing one allocation per candidate
+  std::string characters;
+  std::vector<std::uint32_t> offsets{0};
+
+  // The words of entries that may match the last finished query, see
+  // CompletionEngine::complete. Typing one more character only takes entries
+  // away and takes the state of each word one step further, so each word
+  // keeps how far its state got and a bound on its keys until it is taken
+  // the rest of the way.
+  struct Word {
+    std::uint32_t bucket;
+    std::uint32_t index;
+    std::uint64_t alive;
+    std::uint32_t steps;
+    int bound;
+    std::uint32_t state;
+  };
+  // Bounds on the best score so far of each entry of a word, and its keys
+  struct State {
+    std::array<std::uint8_t, 64> inside;
+    std::array<std::uint8_t, 64> at_word_start;
+    std::array<std::uint8_t, 64> elsewhere;
+    std::array<std::uint8_t, 64> keys;
+  };
+  std::optional<std::string> last_query;
+  std::vector<Word> words;
+  std::vector<State> states;
+
+  // Per batch, its words by bound, highest first, and the matches to score
+  // by key, then those of one key by length
+  struct Pending {
+    int key;
+    std::uint32_t length;
+    std::uint32_t bucket;
+    std::uint32_t entry;
+    std::uint32_t text;
+  };
+  std::vector<std::uint32_t> by_bound;
+  std::vector<std::vector<Pending>> by_key =
+      std::vector<std::vector<Pending>>(UINT8_MAX + 1);
+  std::vector<Pending> ordered;
+  std::vector<std::uint32_t> counts;
+
+  std::vector<int> last_column;
+  std::vector<int> best_left;
+};
@@ -0,0 +1,269 @@
+#include "index.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+namespace {
+auto put_varint(std::vector<std::uint8_t> &bytes, std::uint32_t value)
+    -> void {
+  while (value >= 0x80) {
+    bytes.push_back(static_cast<std::uint8_t>(value | 0x80));
+    value >>= 7;
+  }
+  bytes.push_back(static_cast<std::uint8_t>(value));
+}
+
+auto get_varint(std::uint8_t const *&data) -> std::uint32_t {
+  std::uint32_t value{};
+  auto shift = 0;
+  while (*data & 0x80) {
+    value |= static_cast<std::uint32_t>(*data++ & 0x7f) << shift;
+    shift += 7;
+  }
+  value |= static_cast<std::uint32_t>(*data++) << shift;
+  return value;
+}
+} // namespace
+
+auto FilePostings::encode(
+    std::vector<std::pair<Symbol, std::vector<Position>>> identifiers)
+    -> FilePostings {
+  std::sort(identifiers.begin(), identifiers.end(),
+            [](auto const &a, auto const &b) { return a.first < b.first; });
+  FilePostings postings;
+  postings.sorted_symbols.reserve(identifiers.size());
+  postings.offsets.reserve(identifiers.size());
+  for (auto const &[symbol, positions] : identifiers) {
+    assert(std::is_sorted(positions.begin(), positions.end()) &&
+           "Positions must be sorted");
+    postings.sorted_symbols.push_back(symbol);
+    postings.offsets.push_back(
+        static_cast<std::uint32_t>(postings.bytes.size()));
+    put_varint(postings.bytes, static_cast<std::uint32_t>(positions.size()));
+    Position previous{};
+    for (auto const &position : positions) {
+      // The character restarts from zero whenever the line changes
+      auto line = position.line_number - previous.line_number;
+      auto character = line == 0 ? position.character - previous.character
+                                 : position.character;
+      put_varint(postings.bytes, line);
+      put_varint(postings.bytes, character);
+      previous = position;
+    }
+  }
+  postings.bytes.shrink_to_fit();
+  return postings;
+}
+
+auto FilePostings::symbols() const -> std::vector<Symbol> const & {
+  return sorted_symbols;
+}
+
+auto FilePostings::find(Symbol symbol) const -> std::uint8_t const * {
+  auto found =
+      std::lower_bound(sorted_symbols.begin(), sorted_symbols.end(), symbol);
+  if (found == sorted_symbols.end() || *found != symbol) {
+    return nullptr;
+  }
+  return bytes.data() + offsets[found - sorted_symbols.begin()];
+}
+
+auto FilePostings::count(Symbol symbol) const -> std::size_t {
+  auto const *data = find(symbol);
+  return data == nullptr ? 0 : get_varint(data);
+}
+
+auto FilePostings::decode(Symbol symbol, FileId file,
+                          std::vector<Occurrence> &occurrences) const
+    -> void {
+  auto const *data = find(symbol);
+  if (data == nullptr) {
+    return;
+  }
+  auto count = get_varint(data);
+  Position current{};
+  for (std::uint32_t i = 0; i < count; i++) {
+    auto line = get_varint(data);
+    auto character = get_varint(data);
+    if (line != 0) {
+      current = {current.line_number + line, character};
+    } else {
+      current.character += character;
+    }
+    occurrences.push_back({file, current});
+  }
+}
+
+auto IdentifierIndex::index_files(
+    std::vector<std::filesystem::path> const &paths, std::size_t threads,
+    std::stop_token stop, Filter const &keep)
+    -> std::vector<std::filesystem::path> {
+  if (paths.empty()) {
+    return {};
+  }
+  std::vector<FileId> ids;
+  {
+    std::unique_lock lock(mutex);
+    for (auto const &path : paths) {
+      ids.push_back(file_id(path));
+    }
+  }
+
+  // Lexing is the expensive part and needs no shared state, so only that
+  // runs in parallel and the results are merged afterwards
+  std::vector<FileIdentifiers> results(paths.size());
+  std::vector<char> lexed(paths.size());
+  std::atomic<std::size_t> next{0};
+  auto lex = [&]() {
+    for (auto file = next++; file < paths.size() && !stop.stop_requested();
+         file = next++) {
+      Lexer lexer(paths[file]);
+      results[file] = collect(ids[file], lexer);
+      lexed[file] = true;
+    }
+  };
+  // A caller that is itself one of a fixed set of threads, like a scheduler
+  // job, lexes on its own thread
+  if (auto count = std::clamp<std::size_t>(threads, 1, paths.size());
+      count == 1) {
+    lex();
+  } else {
+    std::vector<std::jthread> workers;
+    for (std::size_t i = 0; i < count; i++) {
+      workers.emplace_back(lex);
+    }
+  }
+  // A file at a time, so a query waits for at most one file's lists to be
+  // rewritten instead of for the whole batch
+  std::vector<std::filesystem::path> unfinished;
+  for (std::size_t i = 0; i < paths.size(); i++) {
+    if (!lexed[i]) {
+      unfinished.push_back(paths[i]);
+      continue;
+    }
+    std::unique_lock lock(mutex);
+    if (!keep || keep(paths[i])) {
+      apply({std::move(results[i])});
+    }
+  }
+  return unfinished;
+}
+
+auto IdentifierIndex::update_file(std::filesystem::path const &path)
+    -> void {
+  index_files({path}, 1);
+}
+
+auto IdentifierIndex::update_file(std::filesystem::path const &path,
+                                  std::string source) -> void {
+  FileId file{};
+  {
+    std::unique_lock lock(mutex);
+    file = file_id(path);
+  }
+  Lexer lexer(path, std::move(source));
+  auto identifiers = collect(file, lexer);
+  std::unique_lock lock(mutex);
+  apply({std::move(identifiers)});
+}
+
+auto IdentifierIndex::remove_file(std::filesystem::path const &path) -> void {
+  std::unique_lock lock(mutex);
+  auto found = file_ids.find(path.lexically_normal().string());
+  if (found == file_ids.end()) {
+    return;
+  }
+  apply({FileIdentifiers{found->second, {}}});
+}
+
+auto IdentifierIndex::find_references(std::string_view name) const
+    -> std::vector<Occurrence> {
+  std::shared_lock lock(mutex);
+  auto symbol = symbols.find(name);
+  if (!symbol.has_value()) {
+    return {};
+  }
+  std::size_t count = 0;
+  for (auto file : symbol_files[*symbol]) {
+    count += postings[file].count(*symbol);
+  }
+  std::vector<Occurrence> occurrences;
+  occurrences.reserve(count);
+  for (auto file : symbol_files[*symbol]) {
+    postings[file].decode(*symbol, file, occurrences);
+  }
+  return occurrences;
+}
+
+auto IdentifierIndex::find_prefix(std::string_view prefix,
+                                  std::size_t limit) const
+    -> std::vector<std::string_view> {
+  std::shared_lock lock(mutex);
+  std::vector<std::string_view> result;
+  for (auto it = sorted_names.lower_bound(prefix);
+       it != sorted_names.end() && it->first.starts_with(prefix) &&
+       result.size() < limit;
+       it++) {
+    if (!symbol_files[it->second].empty()) {
+      result.push_back(it->first);
+    }
+  }
+  return result;
+}
+
+auto IdentifierIndex::file_path(FileId file) const -> std::filesystem::path {
+  std::shared_lock lock(mutex);
+  assert(file < files.size() && "Unknown file");
+  return files[file];
+}
+
+auto IdentifierIndex::collect(FileId file, Lexer &lexer) -> FileIdentifiers {
+  FileIdentifiers result{file, {}};
+  while (auto token = lexer.get_next_token()) {
+    if (auto *identifier = std::get_if<Identifier>(&*token)) {
+      result.identifiers[identifier->value].push_back(identifier->position);
+    }
+  }
+  return result;
+}
+
+auto IdentifierIndex::file_id(std::filesystem::path const &path) -> FileId {
+  auto normal = path.lexically_normal();
+  auto [found, inserted] = file_ids.emplace(
+      normal.string(), static_cast<FileId>(files.size()));
+  if (inserted) {
+    files.push_back(std::move(normal));
+    postings.emplace_back();
+  }
+  return found->second;
+}
+
+auto IdentifierIndex::apply(std::vector<FileIdentifiers> updates) -> void {
+  for (auto &update : updates) {
+    for (auto symbol : postings[update.file].symbols()) {
+      auto &occurs_in = symbol_files[symbol];
+      auto found =
+          std::lower_bound(occurs_in.begin(), occurs_in.end(), update.file);
+      if (found != occurs_in.end() && *found == update.file) {
+        occurs_in.erase(found);
+      }
+    }
+
+    std::vector<std::pair<Symbol, std::vector<Position>>> identifiers;
+    identifiers.reserve(update.identifiers.size());
+    for (auto &[name, positions] : update.identifiers) {
+      auto symbol = symbols.intern(name);
+      if (symbol >= symbol_files.size()) {
+        symbol_files.resize(symbol + 1);
+        sorted_names.emplace(symbols.name(symbol), symbol);
+      }
+      auto &occurs_in = symbol_files[symbol];
+      occurs_in.insert(
+          std::lower_bound(occurs_in.begin(), occurs_in.end(), update.file),
+          update.file);
+      identifiers.emplace_back(symbol, std::move(positions));
+    }
+    postings[update.file] = FilePostings::encode(std::move(identifiers));
+  }
+}
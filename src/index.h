@@ -0,0 +1,104 @@
+#pragma once
+
+#include <interner.h>
+#include <lexer.h>
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <shared_mutex>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using FileId = std::uint32_t;
+
+struct Occurrence {
+  FileId file;
+  Position position;
+
+  auto operator<=>(Occurrence const &other) const = default;
+};
+
+// The positions of every identifier in one file, grouped by identifier and
+// stored as varint encoded deltas in a single buffer. Most deltas fit in a
+// single byte, so a position costs around two bytes.
+class FilePostings {
+public:
+  // `identifiers` holds each symbol once, with its positions in order
+  static auto
+  encode(std::vector<std::pair<Symbol, std::vector<Position>>> identifiers)
+      -> FilePostings;
+  // Sorted
+  auto symbols() const -> std::vector<Symbol> const &;
+  auto count(Symbol symbol) const -> std::size_t;
+  // Appends the occurrences of `symbol` in order
+  auto decode(Symbol symbol, FileId file,
+              std::vector<Occurrence> &occurrences) const -> void;
+
+private:
+  // Start of the list of `symbol`, which begins with its length
+  auto find(Symbol symbol) const -> std::uint8_t const *;
+
+  std::vector<Symbol> sorted_symbols;
+  // Where the list of sorted_symbols[i] starts in `bytes`
+  std::vector<std::uint32_t> offsets;
+  std::vector<std::uint8_t> bytes;
+};
+
+// Maps every identifier the lexer saw in the workspace to where it was seen,
+// for find-references and workspace/symbol. Lexing happens outside the lock,
+// so queries stay answerable while a background batch runs.
+class IdentifierIndex {
+public:
+  using Filter = std::function<bool(std::filesystem::path const &)>;
+
+  // Lexes the files in parallel and replaces what was indexed for them.
+  // Once `stop` is requested, the files lexed so far still go in and the
+  // rest are returned. Results go in one file at a time, and those for paths
+  // `keep` rejects are dropped. It runs under the lock each result is applied
+  // with, so it sees updates made while lexing.
+  auto index_files(std::vector<std::filesystem::path> const &paths,
+                   std::size_t threads = std::thread::hardware_concurrency(),
+                   std::stop_token stop = {}, Filter const &keep = {})
+      -> std::vector<std::filesystem::path>;
+  auto update_file(std::filesystem::path const &path) -> void;
+  // Reindexes `path` from an unsaved editor buffer
+  auto update_file(std::filesystem::path const &path, std::string source)
+      -> void;
+  auto remove_file(std::filesystem::path const &path) -> void;
+
+  auto find_references(std::string_view name) const
+      -> std::vector<Occurrence>;
+  // Indexed identifiers starting with `prefix`, in sorted order
+  auto find_prefix(std::string_view prefix, std::size_t limit) const
+      -> std::vector<std::string_view>;
+  auto file_path(FileId file) const -> std::filesystem::path;
+
+private:
+  struct FileIdentifiers {
+    FileId file;
+    std::unordered_map<std::string, std::vector<Position>> identifiers;
+  };
+
+  static auto collect(FileId file, Lexer &lexer) -> FileIdentifiers;
+  auto file_id(std::filesystem::path const &path) -> FileId;
+  auto apply(std::vector<FileIdentifiers> updates) -> void;
+
+  mutable std::shared_mutex mutex;
+  Interner symbols;
+  // Indexed by Symbol, the sorted files it occurs in
+  std::vector<std::vector<FileId>> symbol_files;
+  // Points into the interner, which never moves its strings
+  std::map<std::string_view, Symbol> sorted_names;
+
+  std::vector<std::filesystem::path> files;
+  std::unordered_map<std::string, FileId> file_ids;
+  // Indexed by FileId. Lists are kept per file, so updating a file rewrites
+  // its own lists and leaves the rest of the workspace alone.
+  std::vector<FilePostings> postings;
+};
@@ -0,0 +1,132 @@
+#include "indexer.h"
+
+#include <algorithm>
+
+BackgroundIndexer::BackgroundIndexer(IdentifierIndex &index,
+                                     Scheduler &scheduler,
+                                     std::size_t batch_size)
+    : index(index), scheduler(scheduler),
+      batch_size(std::max<std::size_t>(batch_size, 1)) {}
+
+auto BackgroundIndexer::update_document(std::filesystem::path const &path,
+                                        std::string source) -> void {
+  auto normal = path.lexically_normal();
+  {
+    std::unique_lock lock(mutex);
+    open_documents.insert(normal);
+  }
+  scheduler.submit("document " + normal.string(), Priority::OpenDocument,
+                   [this, normal, source = std::move(source)](
+                       std::stop_token stop) mutable {
+                     // A newer edit of this document is already queued
+                     if (!stop.stop_requested()) {
+                       index.update_file(normal, std::move(source));
+                     }
+                   });
+}
+
+auto BackgroundIndexer::close_document(std::filesystem::path const &path)
+    -> void {
+  auto normal = path.lexically_normal();
+  {
+    std::unique_lock lock(mutex);
+    open_documents.erase(normal);
+  }
+  // The buffer may have been thrown away unsaved, so go back to the disk
+  scheduler.submit("document " + normal.string(), Priority::OpenDocument,
+                   [this, normal](std::stop_token stop) {
+                     if (!stop.stop_requested()) {
+                       index.update_file(normal);
+                     }
+                   });
+}
+
+auto BackgroundIndexer::index_files(
+    std::vector<std::filesystem::path> const &paths, Priority priority)
+    -> void {
+  if (paths.empty()) {
+    return;
+  }
+  auto level = static_cast<std::size_t>(priority);
+  std::vector<std::string> keys;
+  {
+    std::unique_lock lock(mutex);
+    for (auto const &path : paths) {
+      auto normal = path.lexically_normal();
+      versions[normal]++;
+      pending[level].insert(std::move(normal));
+    }
+    // Running jobs take the new paths along, and the scheduler caps the jobs
+    // that run at once, so lexing never takes more threads than it leaves to
+    // the open documents
+    for (; jobs[level] < scheduler.background_threads(); jobs[level]++) {
+      keys.push_back("batch " + std::to_string(level) + " " +
+                     std::to_string(submitted++));
+    }
+  }
+  for (auto &key : keys) {
+    scheduler.submit(std::move(key), priority,
+                     [this, priority](std::stop_token stop) {
+                       run_batch(priority, stop);
+                     });
+  }
+}
+
+auto BackgroundIndexer::apply(FileChanges const &changes) -> void {
+  // Lexing a file that no longer exists yields nothing, which removes it
+  auto paths = changes.changed;
+  paths.insert(paths.end(), changes.removed.begin(), changes.removed.end());
+  index_files(paths, Priority::Workspace);
+}
+
+auto BackgroundIndexer::watch(FileWatcher &watcher, std::stop_token stop,
+                              std::chrono::milliseconds quiet_period) -> void {
+  while (!stop.stop_requested()) {
+    auto changes = watcher.wait_for_changes(quiet_period, stop);
+    if (!changes.empty()) {
+      apply(changes);
+    }
+  }
+}
+
+auto BackgroundIndexer::run_batch(Priority priority, std::stop_token stop)
+    -> void {
+  auto level = static_cast<std::size_t>(priority);
+  auto &queued = pending[level];
+  while (true) {
+    std::vector<std::filesystem::path> paths;
+    std::map<std::filesystem::path, std::size_t> taken;
+    {
+      std::unique_lock lock(mutex);
+      while (!queued.empty() && paths.size() < batch_size) {
+        auto path = queued.extract(queued.begin()).value();
+        if (!open_documents.contains(path)) {
+          taken.emplace(path, versions[path]);
+          paths.push_back(std::move(path));
+        }
+      }
+      if (paths.empty() || stop.stop_requested()) {
+        queued.insert(paths.begin(), paths.end());
+        jobs[level]--;
+        return;
+      }
+    }
+    // A document opened while the batch lexed has its buffer indexed by now
+    // or soon, which the file on disk must not overwrite. A path queued again
+    // meanwhile is lexed anew by whichever job takes it, so this result is
+    // already stale.
+    auto current = [&](std::filesystem::path const &path) {
+      std::unique_lock lock(mutex);
+      return !open_documents.contains(path) &&
+             versions[path] == taken.at(path);
+    };
+    auto unfinished = index.index_files(paths, 1, stop, current);
+    if (!unfinished.empty()) {
+      // Only the scheduler shutting down stops a job
+      std::unique_lock lock(mutex);
+      queued.insert(unfinished.begin(), unfinished.end());
+      jobs[level]--;
+      return;
+    }
+  }
+}
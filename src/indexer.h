@@ -0,0 +1,60 @@
+#pragma once
+
+#include <index.h>
+#include <scheduler.h>
+#include <watcher.h>
+
+#include <array>
+#include <chrono>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <set>
+#include <stop_token>
+#include <string>
+#include <vector>
+
+// Keeps an IdentifierIndex current in the background: edited documents
+// first, then the files they include, then the rest of the workspace
+class BackgroundIndexer {
+public:
+  // Batches are lexed by scheduler jobs, one per background thread, each
+  // taking `batch_size` files at a time
+  BackgroundIndexer(IdentifierIndex &index, Scheduler &scheduler,
+                    std::size_t batch_size = 64);
+
+  // Reindexes an unsaved buffer. Until the document is closed, the buffer
+  // wins over whatever the file on disk says.
+  auto update_document(std::filesystem::path const &path, std::string source)
+      -> void;
+  auto close_document(std::filesystem::path const &path) -> void;
+  // Files queued at the same priority are lexed together in one batch.
+  // Queuing more while a batch runs adds them to it, and a queued file that
+  // is still being lexed has that result dropped in favour of lexing it anew.
+  auto index_files(std::vector<std::filesystem::path> const &paths,
+                   Priority priority) -> void;
+  auto apply(FileChanges const &changes) -> void;
+  // Feeds changes from `watcher` into the workspace queue until `stop` is
+  // requested
+  auto watch(FileWatcher &watcher, std::stop_token stop,
+             std::chrono::milliseconds quiet_period = std::chrono::milliseconds{
+                 200}) -> void;
+
+private:
+  auto run_batch(Priority priority, std::stop_token stop) -> void;
+
+  IdentifierIndex &index;
+  Scheduler &scheduler;
+  std::size_t batch_size;
+
+  std::mutex mutex;
+  std::set<std::filesystem::path> open_documents;
+  // Indexed by Priority
+  std::array<std::set<std::filesystem::path>, 3> pending;
+  // The jobs that take from each of `pending` until it is empty
+  std::array<std::size_t, 3> jobs{};
+  std::size_t submitted{};
+  // How often each path was queued, to tell a result lexed from an older
+  // version of the file
+  std::map<std::filesystem::path, std::size_t> versions;
+};
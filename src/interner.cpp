@@ -0,0 +1,47 @@
+#include "interner.h"
+
+#include <cassert>
+
+auto Interner::Hash::operator()(std::string_view value) const -> std::size_t {
+  return std::hash<std::string_view>{}(value);
+}
+
+Interner::Interner(Interner const &other)
+    : symbols(other.symbols), names(other.names.size()) {
+  for (auto const &[value, symbol] : symbols) {
+    names[symbol] = &value;
+  }
+}
+
+auto Interner::operator=(Interner const &other) -> Interner & {
+  if (this != &other) {
+    *this = Interner{other};
+  }
+  return *this;
+}
+
+auto Interner::intern(std::string_view value) -> Symbol {
+  auto found = symbols.find(value);
+  if (found != symbols.end()) {
+    return found->second;
+  }
+  auto symbol = static_cast<Symbol>(names.size());
+  auto [inserted, _] = symbols.emplace(std::string{value}, symbol);
+  names.push_back(&inserted->first);
+  return symbol;
+}
+
+auto Interner::find(std::string_view value) const -> std::optional<Symbol> {
+  auto found = symbols.find(value);
+  if (found == symbols.end()) {
+    return {};
+  }
+  return found->second;
+}
+
+auto Interner::name(Symbol symbol) const -> std::string_view {
+  assert(symbol < names.size() && "Unknown symbol");
+  return *names[symbol];
+}
+
+auto Interner::size() const -> std::size_t { return names.size(); }
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+using Symbol = std::uint32_t;
+
+class Interner {
+public:
+  Interner() = default;
+  Interner(Interner const &other);
+  Interner(Interner &&other) = default;
+  auto operator=(Interner const &other) -> Interner &;
+  auto operator=(Interner &&other) -> Interner & = default;
+
+  auto intern(std::string_view value) -> Symbol;
+  auto find(std::string_view value) const -> std::optional<Symbol>;
+  auto name(Symbol symbol) const -> std::string_view;
+  auto size() const -> std::size_t;
+
+private:
+  struct Hash {
+    using is_transparent = void;
+    auto operator()(std::string_view value) const -> std::size_t;
+  };
+
+  std::unordered_map<std::string, Symbol, Hash, std::equal_to<>> symbols;
+  // Keys of a node based map never move, so we can point straight at them
+  std::vector<std::string const *> names;
+};
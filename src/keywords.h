@@ -0,0 +1,149 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+enum class WordKind { Keyword, AlternativeToken };
+
+struct ReservedWord {
+  std::string_view spelling;
+  WordKind kind;
+};
+
+constexpr std::array<ReservedWord, 92> reserved_words{{
+    {"alignas", WordKind::Keyword},
+    {"alignof", WordKind::Keyword},
+    {"asm", WordKind::Keyword},
+    {"auto", WordKind::Keyword},
+    {"bool", WordKind::Keyword},
+    {"break", WordKind::Keyword},
+    {"case", WordKind::Keyword},
+    {"catch", WordKind::Keyword},
+    {"char", WordKind::Keyword},
+    {"char8_t", WordKind::Keyword},
+    {"char16_t", WordKind::Keyword},
+    {"char32_t", WordKind::Keyword},
+    {"class", WordKind::Keyword},
+    {"concept", WordKind::Keyword},
+    {"const", WordKind::Keyword},
+    {"consteval", WordKind::Keyword},
+    {"constexpr", WordKind::Keyword},
+    {"constinit", WordKind::Keyword},
+    {"const_cast", WordKind::Keyword},
+    {"continue", WordKind::Keyword},
+    {"co_await", WordKind::Keyword},
+    {"co_return", WordKind::Keyword},
+    {"co_yield", WordKind::Keyword},
+    {"decltype", WordKind::Keyword},
+    {"default", WordKind::Keyword},
+    {"delete", WordKind::Keyword},
+    {"do", WordKind::Keyword},
+    {"double", WordKind::Keyword},
+    {"dynamic_cast", WordKind::Keyword},
+    {"else", WordKind::Keyword},
+    {"enum", WordKind::Keyword},
+    {"explicit", WordKind::Keyword},
+    {"export", WordKind::Keyword},
+    {"extern", WordKind::Keyword},
+    {"false", WordKind::Keyword},
+    {"float", WordKind::Keyword},
+    {"for", WordKind::Keyword},
+    {"friend", WordKind::Keyword},
+    {"goto", WordKind::Keyword},
+    {"if", WordKind::Keyword},
+    {"inline", WordKind::Keyword},
+    {"int", WordKind::Keyword},
+    {"long", WordKind::Keyword},
+    {"mutable", WordKind::Keyword},
+    {"namespace", WordKind::Keyword},
+    {"new", WordKind::Keyword},
+    {"noexcept", WordKind::Keyword},
+    {"nullptr", WordKind::Keyword},
+    {"operator", WordKind::Keyword},
+    {"private", WordKind::Keyword},
+    {"protected", WordKind::Keyword},
+    {"public", WordKind::Keyword},
+    {"register", WordKind::Keyword},
+    {"reinterpret_cast", WordKind::Keyword},
+    {"requires", WordKind::Keyword},
+    {"return", WordKind::Keyword},
+    {"short", WordKind::Keyword},
+    {"signed", WordKind::Keyword},
+    {"sizeof", WordKind::Keyword},
+    {"static", WordKind::Keyword},
+    {"static_assert", WordKind::Keyword},
+    {"static_cast", WordKind::Keyword},
+    {"struct", WordKind::Keyword},
+    {"switch", WordKind::Keyword},
+    {"template", WordKind::Keyword},
+    {"this", WordKind::Keyword},
+    {"thread_local", WordKind::Keyword},
+    {"throw", WordKind::Keyword},
+    {"true", WordKind::Keyword},
+    {"try", WordKind::Keyword},
+    {"typedef", WordKind::Keyword},
+    {"typeid", WordKind::Keyword},
+    {"typename", WordKind::Keyword},
+    {"union", WordKind::Keyword},
+    {"unsigned", WordKind::Keyword},
+    {"using", WordKind::Keyword},
+    {"virtual", WordKind::Keyword},
+    {"void", WordKind::Keyword},
+    {"volatile", WordKind::Keyword},
+    {"wchar_t", WordKind::Keyword},
+    {"while", WordKind::Keyword},
+    {"and", WordKind::AlternativeToken},
+    {"and_eq", WordKind::AlternativeToken},
+    {"bitand", WordKind::AlternativeToken},
+    {"bitor", WordKind::AlternativeToken},
+    {"compl", WordKind::AlternativeToken},
+    {"not", WordKind::AlternativeToken},
+    {"not_eq", WordKind::AlternativeToken},
+    {"or", WordKind::AlternativeToken},
+    {"or_eq", WordKind::AlternativeToken},
+    {"xor", WordKind::AlternativeToken},
+    {"xor_eq", WordKind::AlternativeToken},
+}};
+
+// FNV-1a with a seed picked so that no two reserved words share a slot, which
+// makes every lookup a single probe and a single comparison
+constexpr std::uint32_t reserved_word_seed = 6370;
+constexpr std::size_t reserved_word_slots = 512;
+constexpr std::size_t longest_reserved_word = 16;
+
+constexpr auto reserved_word_slot(std::string_view word) -> std::size_t {
+  auto hash = reserved_word_seed;
+  for (auto c : word) {
+    hash = (hash ^ static_cast<unsigned char>(c)) * 0x01000193u;
+  }
+  return hash >> 23;
+}
+
+// Slot to index into reserved_words plus one, zero for empty slots
+constexpr auto reserved_word_table =
+    []() -> std::array<std::uint8_t, reserved_word_slots> {
+  std::array<std::uint8_t, reserved_word_slots> table{};
+  for (std::size_t i = 0; i < reserved_words.size(); i++) {
+    auto &slot = table[reserved_word_slot(reserved_words[i].spelling)];
+    if (slot != 0) {
+      // Not a constant expression, so a collision fails the build
+      throw "reserved_word_seed no longer gives a perfect hash";
+    }
+    slot = static_cast<std::uint8_t>(i + 1);
+  }
+  return table;
+}();
+
+constexpr auto classify_word(std::string_view word) -> std::optional<WordKind> {
+  if (word.size() < 2 || word.size() > longest_reserved_word) {
+    return {};
+  }
+  auto entry = reserved_word_table[reserved_word_slot(word)];
+  if (entry == 0 || reserved_words[entry - 1].spelling != word) {
+    return {};
+  }
+  return reserved_words[entry - 1].kind;
+}
@@ -1,5 +1,117 @@
 #include "lexer.h"
 #include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstring>
+#include <iterator>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+auto is_space(char c) -> bool {
+  return std::isspace(static_cast<unsigned char>(c)) != 0;
+}
+
+// A backslash before the newline joins the next line onto this one
+auto is_spliced(char const *data, char const *newline) -> bool {
+  if (newline != data && newline[-1] == '\r') {
+    newline--;
+  }
+  return newline != data && newline[-1] == '\\';
+}
+
+struct Bracket {
+  char closing;
+  bool opening;
+};
+
+auto classify_bracket(PreProcessorToken const &token) -> std::optional<Bracket> {
+  auto const *punctuator = std::get_if<OperatorOrPunctuator>(&token);
+  if (punctuator == nullptr || punctuator->value.size() > 2) {
+    return {};
+  }
+  constexpr std::array<std::pair<std::string_view, Bracket>, 10> brackets{{
+      {"(", {')', true}},
+      {")", {')', false}},
+      {"[", {']', true}},
+      {"]", {']', false}},
+      {"{", {'}', true}},
+      {"}", {'}', false}},
+      {"<:", {']', true}},
+      {":>", {']', false}},
+      {"<%", {'}', true}},
+      {"%>", {'}', false}},
+  }};
+  for (auto const &[spelling, bracket] : brackets) {
+    if (punctuator->value == spelling) {
+      return bracket;
+    }
+  }
+  return {};
+}
+
+// Whether `raw` ends inside a pp-number, where a quote is a digit separator
+// rather than the start of a character literal as it is after an encoding
+// prefix like L, u, U or u8
+auto ends_in_ppnumber(std::string_view raw) -> bool {
+  auto start = raw.size();
+  while (start > 0 && (is_digit(raw[start - 1]) ||
+                       is_nondigit(raw[start - 1]) || raw[start - 1] == '.' ||
+                       raw[start - 1] == '\'' || !is_ascii(raw[start - 1]))) {
+    start--;
+  }
+  auto run = raw.substr(start);
+  return !run.empty() &&
+         (is_digit(run[0]) ||
+          (run[0] == '.' && run.size() > 1 && is_digit(run[1])));
+}
+
+auto starts_comment(std::string_view text) -> bool {
+  return text.starts_with("//") || text.starts_with("/*");
+}
+
+// Points past the "*/" that closes a block comment, or at `end` if there is
+// none. Licence headers and doc blocks are long, so they are searched 16
+// bytes at a time rather than stopping at every '*'.
+auto find_block_comment_end(char const *it, char const *end) -> char const * {
+#if defined(__SSE2__)
+  auto star = _mm_set1_epi8('*');
+  auto slash = _mm_set1_epi8('/');
+  while (end - it > 16) {
+    auto block = _mm_loadu_si128(reinterpret_cast<__m128i const *>(it));
+    auto next = _mm_loadu_si128(reinterpret_cast<__m128i const *>(it + 1));
+    auto found = static_cast<unsigned>(_mm_movemask_epi8(_mm_and_si128(
+        _mm_cmpeq_epi8(block, star), _mm_cmpeq_epi8(next, slash))));
+    if (found != 0) {
+      return it + std::countr_zero(found) + 2;
+    }
+    it += 16;
+  }
+#endif
+  for (; end - it > 1; it++) {
+    if (it[0] == '*' && it[1] == '/') {
+      return it + 2;
+    }
+  }
+  return end;
+}
+
+// Points at the newline that ends a line comment, or at `end` if there is
+// none
+auto find_line_comment_end(char const *data, char const *it, char const *end)
+    -> char const * {
+  while (auto const *newline = static_cast<char const *>(
+             std::memchr(it, '\n', static_cast<std::size_t>(end - it)))) {
+    if (!is_spliced(data, newline)) {
+      return newline;
+    }
+    it = newline + 1;
+  }
+  return end;
+}
+} // namespace
 
 std::ostream &operator<<(std::ostream &os, const Position &dt) {
   os << "Position(" << dt.line_number << ":" << dt.character << ")";
@@ -60,6 +172,12 @@ std::ostream &operator<<(std::ostream &os, const Identifier &dt) {
   return os;
 }
 
+std::ostream &operator<<(std::ostream &os, const Keyword &dt) {
+  os << std::setw(31) << "Keyword(" << dt.position.line_number << ":"
+     << dt.position.character << ")\t\"" << dt.value << "\"";
+  return os;
+}
+
 std::ostream &operator<<(std::ostream &os, const PPNumber &dt) {
   os << std::setw(31) << "PPNumber(" << dt.position.line_number << ":"
      << dt.position.character << ")\t\"" << dt.value << "\"";
@@ -73,7 +191,7 @@ std::ostream &operator<<(std::ostream &os, const OperatorOrPunctuator &dt) {
 }
 
 using PreProcessorToken =
-    std::variant<RawPreprocessorToken, NewLine, Identifier, PPNumber,
+    std::variant<RawPreprocessorToken, NewLine, Identifier, Keyword, PPNumber,
                  OperatorOrPunctuator, StringLiteral>;
 
 std::ostream &operator<<(std::ostream &os, const PreProcessorToken &dt) {
@@ -81,80 +199,372 @@ std::ostream &operator<<(std::ostream &os, const PreProcessorToken &dt) {
   return os;
 }
 
-Lexer::Lexer(std::filesystem::path const &path) : path(path), istream(path){};
+auto classify_identifier(std::string value, Position position)
+    -> PreProcessorToken {
+  auto kind = classify_word(value);
+  if (!kind.has_value()) {
+    return Identifier{std::move(value), position};
+  }
+  if (*kind == WordKind::Keyword) {
+    return Keyword{std::move(value), position};
+  }
+  return OperatorOrPunctuator{std::move(value), position};
+}
+
+auto token_spelling(PreProcessorToken const &token) -> std::string {
+  if (auto *string_literal = std::get_if<StringLiteral>(&token)) {
+    return string_literal->encoding_prefix.value_or("") +
+           string_literal->raw_token + string_literal->suffix.value_or("");
+  } else if (auto *raw_token = std::get_if<RawPreprocessorToken>(&token)) {
+    return raw_token->raw_token;
+  } else if (std::holds_alternative<NewLine>(token)) {
+    return "\n";
+  }
+  return std::visit(
+      [](auto &&arg) -> std::string {
+        if constexpr (requires { arg.value; }) {
+          return arg.value;
+        } else {
+          return {};
+        }
+      },
+      token);
+}
+
+auto token_position(PreProcessorToken const &token) -> Position {
+  return std::visit([](auto &&arg) { return arg.position; }, token);
+}
+
+auto set_token_position(PreProcessorToken &token, Position position) -> void {
+  std::visit([&](auto &&arg) { arg.position = position; }, token);
+}
+
+auto TokenStream::push(PreProcessorToken token) -> void {
+  auto index = static_cast<std::uint32_t>(tokens.size());
+  auto bracket = classify_bracket(token);
+  tokens.push_back(std::move(token));
+  brackets.push_back(unmatched);
+  if (!bracket.has_value()) {
+    return;
+  }
+  if (bracket->opening) {
+    open_brackets.push_back(index);
+  } else {
+    close(index);
+  }
+}
+
+auto TokenStream::close(std::uint32_t token) -> void {
+  if (open_brackets.empty()) {
+    unopened_brackets.push_back(token);
+    return;
+  }
+  auto open = open_brackets.back();
+  if (classify_bracket(tokens[open])->closing !=
+      classify_bracket(tokens[token])->closing) {
+    return;
+  }
+  open_brackets.pop_back();
+  brackets[open] = token;
+  brackets[token] = open;
+}
+
+auto TokenStream::append(TokenStream &&other) -> void {
+  auto base = static_cast<std::uint32_t>(tokens.size());
+  std::move(other.tokens.begin(), other.tokens.end(),
+            std::back_inserter(tokens));
+  for (auto bracket : other.brackets) {
+    brackets.push_back(bracket == unmatched ? unmatched : bracket + base);
+  }
+  // Every unopened bracket comes before every bracket `other` left open, so
+  // closing them first pairs them as lexing it all in one go would have
+  for (auto token : other.unopened_brackets) {
+    close(token + base);
+  }
+  for (auto token : other.open_brackets) {
+    open_brackets.push_back(token + base);
+  }
+}
+
+auto TokenStream::matching_bracket(std::size_t token) const
+    -> std::optional<std::size_t> {
+  if (token >= brackets.size() || brackets[token] == unmatched) {
+    return {};
+  }
+  return brackets[token];
+}
+
+auto TokenStream::token_at(Position position) const
+    -> std::optional<std::size_t> {
+  auto after = std::partition_point(
+      tokens.begin(), tokens.end(), [&](PreProcessorToken const &token) {
+        return token_position(token) <= position;
+      });
+  if (after == tokens.begin()) {
+    return {};
+  }
+  return static_cast<std::size_t>(after - tokens.begin()) - 1;
+}
+
+auto TokenStream::folding_ranges() const -> std::vector<FoldingRange> {
+  std::vector<FoldingRange> ranges;
+  for (std::size_t open = 0; open < brackets.size(); open++) {
+    auto close = brackets[open];
+    if (close == unmatched || close < open) {
+      continue;
+    }
+    auto start_line = token_position(tokens[open]).line_number;
+    auto end_line = token_position(tokens[close]).line_number;
+    if (end_line > start_line) {
+      ranges.push_back({start_line, end_line});
+    }
+  }
+  return ranges;
+}
+
+Lexer::Lexer(std::filesystem::path const &path) : path(path) {
+  std::ifstream istream(path, std::ios::binary);
+  source = std::make_shared<std::string const>(
+      std::istreambuf_iterator<char>(istream),
+      std::istreambuf_iterator<char>());
+  text = *source;
+  invalid_utf8_offset = find_invalid_utf8(text);
+};
+
+Lexer::Lexer(std::filesystem::path const &path, std::string source)
+    : path(path),
+      source(std::make_shared<std::string const>(std::move(source))),
+      text(*this->source), invalid_utf8_offset(find_invalid_utf8(text)){};
+
+auto Lexer::get(char &c) -> bool {
+  if (cursor >= text.size()) {
+    return false;
+  }
+  c = text[cursor++];
+  return true;
+}
+
+auto Lexer::putback() -> void {
+  assert(cursor > 0 && "Cannot put back before the start of the buffer");
+  cursor--;
+}
+
+auto Lexer::set_comment_mode(CommentMode mode) -> void { comment_mode = mode; }
+
+auto Lexer::comments() const -> std::vector<Trivia> const & {
+  return comment_spans;
+}
+
+auto Lexer::position() const -> Position { return pos; }
+
+auto Lexer::offset() const -> std::size_t { return cursor; }
+
+auto Lexer::file() const -> std::filesystem::path const & { return path; }
+
+auto Lexer::contents() const -> std::string_view { return text; }
+
+auto Lexer::invalid_utf8() const -> std::optional<Position> {
+  if (!invalid_utf8_offset.has_value()) {
+    return {};
+  }
+  auto before = text.substr(0, *invalid_utf8_offset);
+  auto line_start = before.rfind('\n');
+  line_start = line_start == std::string_view::npos ? 0 : line_start + 1;
+  auto lines = std::count(before.begin(), before.end(), '\n');
+  return Position{static_cast<std::uint32_t>(lines),
+                  static_cast<std::uint32_t>(before.size() - line_start)};
+}
+
+auto Lexer::seek(std::size_t offset, Position position) -> void {
+  assert(offset <= text.size() && "Cannot seek past the end of the buffer");
+  cursor = offset;
+  pos = position;
+  token_buffer.reset();
+}
+
+auto Lexer::skip_to_directive() -> bool {
+  if (cursor >= text.size()) {
+    return false;
+  }
+  assert(!token_buffer.has_value() && pos.character == 0 &&
+         "Can only skip from the start of a line");
+  auto const *data = text.data();
+  auto const *end = data + text.size();
+  auto const *line = data + cursor;
+  auto is_blank = [](char c) {
+    return c == ' ' || c == '\t' || c == '\f' || c == '\v' || c == '\r';
+  };
+  // The next '#' is only searched for again once `line` passes it, so
+  // comments between directives far apart do not rescan the gap each time
+  char const *hash = nullptr;
+  while (line != end) {
+    if (hash == nullptr || hash < line) {
+      hash = static_cast<char const *>(
+          std::memchr(line, '#', static_cast<std::size_t>(end - line)));
+      if (hash == nullptr) {
+        break;
+      }
+    }
+    // A block comment can hide a whole line starting with '#', as long as the
+    // opening is not inside a line comment or a string such as "src/*.cpp"
+    auto comment = std::string_view(line, hash).find("/*");
+    if (comment != std::string_view::npos) {
+      auto const *opening = line + comment;
+      auto line_start = std::string_view(line, opening).rfind('\n');
+      auto before = std::string_view(
+          line_start == std::string_view::npos ? line : line + line_start + 1,
+          opening);
+      if (before.find("//") == std::string_view::npos &&
+          std::count(before.begin(), before.end(), '"') % 2 == 0) {
+        line = find_block_comment_end(opening + 2, end);
+      } else {
+        // Look for another opening on the lines after this one
+        auto const *newline = static_cast<char const *>(std::memchr(
+            opening, '\n', static_cast<std::size_t>(end - opening)));
+        line = newline == nullptr ? end : newline + 1;
+      }
+      continue;
+    }
+    auto const *begin = hash;
+    while (begin != line && is_blank(begin[-1])) {
+      begin--;
+    }
+    if (begin == data ||
+        (begin[-1] == '\n' && !is_spliced(data, begin - 1))) {
+      pos.line_number += std::count(data + cursor, begin, '\n');
+      cursor = begin - data;
+      return true;
+    }
+    auto const *newline = static_cast<char const *>(
+        std::memchr(hash, '\n', static_cast<std::size_t>(end - hash)));
+    if (newline == nullptr) {
+      break;
+    }
+    line = newline + 1;
+  }
+  // The end of the file, which may come after a last line without a newline
+  auto rest = std::string_view(data + cursor, end);
+  auto last_newline = rest.rfind('\n');
+  pos.line_number += std::count(rest.begin(), rest.end(), '\n');
+  pos.character =
+      last_newline == std::string_view::npos ? rest.size()
+                                             : rest.size() - last_newline - 1;
+  cursor = text.size();
+  return false;
+}
 
 auto Lexer::parse_string_literal() -> std::optional<StringLiteral> {
   std::string buffer;
   std::string extra_pre_whitespace;
   bool is_string_literal{false};
   bool string_literal{false};
+  // Set between the opening quote of a raw string and its closing delimiter
+  std::optional<std::string> raw_delimiter;
+  std::size_t raw_body{};
   auto current_pos = pos;
   auto new_pos = pos;
+  auto advance = [&](char c) {
+    if (c == '\n') {
+      new_pos.character = 0;
+      new_pos.line_number += 1;
+    } else {
+      new_pos.character += 1;
+    }
+  };
   char c;
-  while (istream.get(c)) {
+  while (get(c)) {
+    if (raw_delimiter.has_value()) {
+      // Neither escapes nor line splices apply inside a raw string
+      buffer += c;
+      advance(c);
+      if (raw_body == 0) {
+        if (c == '(') {
+          raw_body = buffer.size();
+        } else if (is_space(c) || c == '\\' || c == ')' ||
+                   raw_delimiter->size() == 16) {
+          // Not a valid delimiter, so lex the rest like an ordinary string
+          raw_delimiter.reset();
+        } else {
+          raw_delimiter->push_back(c);
+        }
+      } else if (c == '"' &&
+                 buffer.size() - raw_body >= raw_delimiter->size() + 2 &&
+                 buffer.ends_with(")" + *raw_delimiter + "\"")) {
+        raw_delimiter.reset();
+        string_literal = false;
+        is_string_literal = true;
+      }
+      continue;
+    }
     if (c == '\\') {
       char peek;
-      if (istream.get(peek)) {
+      if (get(peek)) {
         if (peek == '\"' && !string_literal) {
-          istream.putback(peek);
+          putback();
+          putback();
           break;
-        } else if (peek == '\n' || peek == '\"') {
+        } else if (peek == '\n' || string_literal) {
+          // A line splice, or an escape sequence that must not end the string
           buffer += c;
           buffer += peek;
-          new_pos.character = 0;
-          new_pos.line_number += 2;
+          advance(c);
+          advance(peek);
           continue;
         }
-        istream.putback(peek);
+        putback();
       }
     }
     if (c == '\"') {
       if (is_string_literal == true) {
-        istream.putback(c);
+        putback();
         break;
       }
       if (string_literal == true) {
         is_string_literal = true;
+      } else if (buffer == "R" || buffer == "LR" || buffer == "uR" ||
+                 buffer == "UR" || buffer == "u8R") {
+        raw_delimiter.emplace();
       }
       string_literal = !string_literal;
       buffer += c;
-      new_pos.character += 1;
+      advance(c);
       continue;
     }
 
-    if ((std::isspace(c) || !(is_digit(c) || is_nondigit(c))) &&
+    // Bytes outside ASCII may belong to an identifier prefix or suffix
+    if ((is_space(c) || !(is_digit(c) || is_nondigit(c) || !is_ascii(c))) &&
         !string_literal) {
-      if (std::isspace(c) && c != '\n' && buffer.empty()) {
+      if (is_space(c) && c != '\n' && buffer.empty()) {
         extra_pre_whitespace += c;
-        new_pos.character += 1;
+        advance(c);
         continue;
       }
-      istream.putback(c);
+      putback();
       break;
     }
     buffer += c;
-    new_pos.character += 1;
+    advance(c);
   }
 
   if (buffer.empty()) {
-    std::for_each(extra_pre_whitespace.rbegin(), buffer.rend(),
-                  [&](char c) { istream.putback(c); });
+    std::for_each(extra_pre_whitespace.rbegin(), extra_pre_whitespace.rend(),
+                  [&](char) { putback(); });
     return {};
   }
 
   if (is_string_literal == false) {
     std::for_each(buffer.rbegin(), buffer.rend(),
-                  [&](char c) { istream.putback(c); });
-    std::for_each(extra_pre_whitespace.rbegin(), buffer.rend(),
-                  [&](char c) { istream.putback(c); });
+                  [&](char) { putback(); });
+    std::for_each(extra_pre_whitespace.rbegin(), extra_pre_whitespace.rend(),
+                  [&](char) { putback(); });
     return {};
   }
   auto prefix = read_identifier(buffer.begin(), buffer.end());
   if (buffer.front() != '\"' && !prefix.has_value()) {
     std::for_each(buffer.rbegin(), buffer.rend(),
-                  [&](char c) { istream.putback(c); });
-    std::for_each(extra_pre_whitespace.rbegin(), buffer.rend(),
-                  [&](char c) { istream.putback(c); });
+                  [&](char) { putback(); });
+    std::for_each(extra_pre_whitespace.rbegin(), extra_pre_whitespace.rend(),
+                  [&](char) { putback(); });
     // TODO: We should probably error here
     std::cerr << "Invalid prefix value in " << buffer << '\n';
     return {};
@@ -170,9 +580,9 @@ auto Lexer::parse_string_literal() -> std::optional<StringLiteral> {
         read_identifier(buffer.begin() + end_of_string + 1, buffer.end());
     if (!maybe_suffix.has_value()) {
       std::for_each(buffer.rbegin(), buffer.rend(),
-                    [&](char c) { istream.putback(c); });
-      std::for_each(extra_pre_whitespace.rbegin(), buffer.rend(),
-                    [&](char c) { istream.putback(c); });
+                    [&](char) { putback(); });
+      std::for_each(extra_pre_whitespace.rbegin(), extra_pre_whitespace.rend(),
+                    [&](char) { putback(); });
       // TODO: We should probably error here
       std::cerr << "Invalid suffix value in " << buffer << '\n';
       return {};
@@ -213,7 +623,7 @@ auto Lexer::get_next_token() -> std::optional<PreProcessorToken> {
             raw_token->cut(value.length());
             raw_token->position.character += value.length();
           }
-          return Identifier{std::move(value), ret_pos};
+          return classify_identifier(std::move(value), ret_pos);
         }
       }
       {
@@ -255,6 +665,34 @@ auto Lexer::get_next_token() -> std::optional<PreProcessorToken> {
   return get_next_token();
 }
 
+auto Lexer::skip_comment() -> bool {
+  auto rest = text.substr(cursor);
+  if (!starts_comment(rest)) {
+    return false;
+  }
+  auto const *data = text.data();
+  auto const *begin = data + cursor;
+  auto const *end = data + text.size();
+  // A line comment leaves its newline to end the line, a block comment takes
+  // its newlines with it
+  auto const *comment_end = rest[1] == '/'
+                                ? find_line_comment_end(data, begin + 2, end)
+                                : find_block_comment_end(begin + 2, end);
+  auto comment = std::string_view(begin, comment_end);
+  auto last_newline = comment.rfind('\n');
+  if (last_newline == std::string_view::npos) {
+    pos.character += comment.size();
+  } else {
+    pos.line_number += std::count(comment.begin(), comment.end(), '\n');
+    pos.character = comment.size() - last_newline - 1;
+  }
+  if (comment_mode == CommentMode::Retain) {
+    comment_spans.push_back({cursor, comment.size()});
+  }
+  cursor += comment.size();
+  return true;
+}
+
 auto Lexer::get_raw_token() -> std::optional<PreProcessorToken> {
   char c;
   std::string raw_buffer;
@@ -263,25 +701,73 @@ auto Lexer::get_raw_token() -> std::optional<PreProcessorToken> {
   if (string_literal.has_value()) {
     return string_literal;
   }
-  while (istream.get(c)) {
+  while (get(c)) {
     if (c == '\\') {
       char peek;
-      if (istream.get(peek)) {
+      if (get(peek)) {
         if (peek == '\n') {
           pos.character = 0;
           pos.line_number += 1;
           continue;
         }
-        istream.putback(peek);
+        putback();
+      }
+    }
+    if (c == '/' && starts_comment(text.substr(cursor - 1))) {
+      putback();
+      if (!raw_buffer.empty()) {
+        break;
+      }
+      skip_comment();
+      // The comment counts as whitespace, so a string literal may follow
+      auto string_literal = parse_string_literal();
+      if (string_literal.has_value()) {
+        return string_literal;
+      }
+      ret_pos = pos;
+      continue;
+    }
+    if (c == '"' && !raw_buffer.empty() && !is_digit(raw_buffer.back()) &&
+        !is_nondigit(raw_buffer.back()) && is_ascii(raw_buffer.back())) {
+      // A string literal after punctuation, as in f("//"), starts a token of
+      // its own so it is lexed as one
+      putback();
+      break;
+    }
+    if (c == '"' || (c == '\'' && !ends_in_ppnumber(raw_buffer))) {
+      // Keeps quoted text that is not lexed as a string literal, such as a
+      // character literal or a string with a prefix, out of comment detection
+      auto quote = c;
+      raw_buffer += c;
+      pos.character += 1;
+      while (get(c)) {
+        if (c == '\n') {
+          putback();
+          break;
+        }
+        raw_buffer += c;
+        pos.character += 1;
+        if (c == quote) {
+          break;
+        }
+        if (c == '\\' && get(c)) {
+          if (c == '\n') {
+            putback();
+            continue;
+          }
+          raw_buffer += c;
+          pos.character += 1;
+        }
       }
+      continue;
     }
-    if (std::isspace(c)) {
+    if (is_space(c)) {
       if (c == '\n' && raw_buffer.empty()) {
         pos.character = 0;
         pos.line_number += 1;
         return NewLine{ret_pos};
       } else if (c == '\n') {
-        istream.putback(c);
+        putback();
         break;
       }
       pos.character += 1;
@@ -300,10 +786,97 @@ auto Lexer::get_raw_token() -> std::optional<PreProcessorToken> {
   return RawPreprocessorToken{raw_buffer, ret_pos};
 };
 
-auto Lexer::print() -> void {
-  char c;
-  while (istream.get(c)) {
-    std::cout << c;
+auto Lexer::get_all_tokens(std::size_t threads, std::size_t chunk_size)
+    -> TokenStream {
+  TokenStream tokens;
+  // Every chunk starts right after a newline and is lexed as if that was the
+  // start of a file. That guess only fails where a token spans lines, like a
+  // raw string or a block comment, and those chunks are lexed again while
+  // merging.
+  threads = std::max<std::size_t>(threads, 1);
+  auto remaining = text.size() - cursor;
+  auto count = std::min(remaining / std::max<std::size_t>(chunk_size, 1),
+                        threads * 4);
+  std::vector<std::size_t> starts;
+  for (std::size_t i = 1; i < count; i++) {
+    auto from = std::max(cursor + remaining * i / count,
+                         starts.empty() ? cursor : starts.back());
+    auto newline = text.find('\n', from);
+    if (newline == std::string_view::npos || newline + 1 == text.size()) {
+      break;
+    }
+    starts.push_back(newline + 1);
   }
-  istream = std::ifstream(path);
-};
+  if (threads == 1 || starts.empty()) {
+    lex_until(text.size(), tokens);
+    return tokens;
+  }
+
+  struct Chunk {
+    TokenStream tokens;
+    std::vector<Trivia> comments;
+    std::size_t end;
+    // Counted from the start of the chunk
+    Position end_position;
+  };
+  std::vector<Chunk> chunks(starts.size());
+  {
+    auto prototype = *this;
+    prototype.comment_spans.clear();
+    std::atomic<std::size_t> next{0};
+    std::vector<std::jthread> workers;
+    for (std::size_t i = 0; i < std::min(threads - 1, starts.size()); i++) {
+      workers.emplace_back([&]() {
+        for (auto chunk = next++; chunk < starts.size(); chunk = next++) {
+          auto lexer = prototype;
+          lexer.seek(starts[chunk], {});
+          lexer.lex_until(chunk + 1 < starts.size() ? starts[chunk + 1]
+                                                    : text.size(),
+                          chunks[chunk].tokens);
+          chunks[chunk].comments = std::move(lexer.comment_spans);
+          chunks[chunk].end = lexer.cursor;
+          chunks[chunk].end_position = lexer.pos;
+        }
+      });
+    }
+    // Everything before the first chunk is lexed from the real state
+    lex_until(starts.front(), tokens);
+  }
+
+  for (std::size_t chunk = 0; cursor < text.size();) {
+    while (chunk < starts.size() && starts[chunk] < cursor) {
+      chunk++;
+    }
+    if (chunk == starts.size() || starts[chunk] != cursor) {
+      // A token ran into the chunk, so its speculative tokens are wrong
+      lex_until(chunk < starts.size() ? starts[chunk] : text.size(), tokens);
+      continue;
+    }
+    auto line = pos.line_number;
+    for (auto &token : chunks[chunk].tokens.tokens) {
+      auto position = token_position(token);
+      position.line_number += line;
+      set_token_position(token, position);
+    }
+    tokens.append(std::move(chunks[chunk].tokens));
+    comment_spans.insert(comment_spans.end(), chunks[chunk].comments.begin(),
+                         chunks[chunk].comments.end());
+    auto end_position = chunks[chunk].end_position;
+    seek(chunks[chunk].end,
+         {line + end_position.line_number, end_position.character});
+    chunk++;
+  }
+  return tokens;
+}
+
+auto Lexer::lex_until(std::size_t limit, TokenStream &tokens) -> void {
+  while (auto token = get_next_token()) {
+    auto newline = std::holds_alternative<NewLine>(*token);
+    tokens.push(std::move(*token));
+    if (newline && cursor >= limit) {
+      return;
+    }
+  }
+}
+
+auto Lexer::print() -> void { std::cout << text; };
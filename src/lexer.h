@@ -2,6 +2,7 @@
 
 #include <cassert>
 #include <cctype>
+#include <compare>
 #include <cstdint>
 #include <filesystem>
 
@@ -11,13 +12,21 @@
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <keywords.h>
+#include <limits>
+#include <memory>
 #include <optional>
 #include <string>
+#include <thread>
+#include <unicode.h>
 #include <variant>
+#include <vector>
 
 struct Position {
   std::uint32_t line_number;
   std::uint32_t character;
+
+  auto operator<=>(Position const &other) const = default;
 };
 
 std::ostream &operator<<(std::ostream &os, const Position &dt);
@@ -27,21 +36,13 @@ struct NewLine {
 };
 
 std::ostream &operator<<(std::ostream &os, const NewLine &dt);
-std::array<char, 53> constexpr nondigits{
-    'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n',
-    'o', 'p', 'q', 'r', 's', 't', 'u', 'v', 'w', 'x', 'y', 'z', 'A', 'B',
-    'C', 'D', 'E', 'F', 'G', 'H', 'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P',
-    'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X', 'Y', 'Z', '_'};
-
-inline auto is_nondigit(char item) -> bool {
-  return std::find(nondigits.begin(), nondigits.end(), item) != nondigits.end();
+constexpr auto is_nondigit(char item) -> bool {
+  return (item >= 'a' && item <= 'z') || (item >= 'A' && item <= 'Z') ||
+         item == '_';
 };
 
-std::array<char, 10> constexpr digits{'0', '1', '2', '3', '4',
-                                      '5', '6', '7', '8', '9'};
-
-inline auto is_digit(char item) -> bool {
-  return std::find(digits.begin(), digits.end(), item) != digits.end();
+constexpr auto is_digit(char item) -> bool {
+  return item >= '0' && item <= '9';
 };
 
 template <typename T>
@@ -139,22 +140,32 @@ struct StringLiteral {
 
 std::ostream &operator<<(std::ostream &os, const StringLiteral &dt);
 
+// Identifiers may also contain XID_Start and XID_Continue characters,
+// written as UTF-8 or as universal character names, which keep their
+// spelling
 template <typename T>
 constexpr auto read_identifier(T begin, T end) -> std::optional<std::string> {
-  if (begin == end) {
-    return {};
-  }
-
-  if (!is_nondigit(*begin)) {
-    return {};
-  }
-
   std::string buffer;
-  for (; begin != end; begin++) {
-    if (!is_nondigit(*begin) && !is_digit(*begin)) {
+  while (begin != end) {
+    auto c = *begin;
+    if (is_ascii(c) && c != '\\') {
+      if (!is_nondigit(c) && (buffer.empty() || !is_digit(c))) {
+        break;
+      }
+      buffer += c;
+      begin++;
+      continue;
+    }
+    auto next = begin;
+    auto code_point = c == '\\' ? read_universal_character_name(next, end)
+                                 : decode_utf8(next, end);
+    if (!code_point.has_value() ||
+        !(buffer.empty() ? is_xid_start(*code_point)
+                         : is_xid_continue(*code_point))) {
       break;
     }
-    buffer += *begin;
+    buffer.append(begin, next);
+    begin = next;
   }
   if (buffer.empty()) {
     return {};
@@ -162,16 +173,15 @@ constexpr auto read_identifier(T begin, T end) -> std::optional<std::string> {
   return buffer;
 }
 
-constexpr std::array<std::string_view, 71> operators = {
-    {"not_eq", "xor_eq", "or_eq", "and_eq", "compl", "bitor", "bitand", "<=>",
-     ">>=",    "<<=",    "xor",   "or",     "and",   "not",   "->*",    "->",
-     "new",    "delete", "%:%:",  "%:",     "%>",    "<%",    ":>",     "<:",
-     "##",     "--",     "++",    "&&",     "||",    "!=",    "==",     "^=",
-     "&=",     "|=",     "<<",    ">>",     "%=",    "/=",    "*=",     ".*",
-     ">=",     "<=",     "-=",    "+=",     "...",   "^",     "&",      "|",
-     "%",      "/",      "*",     "?",      ",",     "-",     "+",      "!",
-     "~",      "::",     ".",     ":",      ";",     ")",     "=",      "<",
-     ">",      "(",      "]",     "[",      "}",     "{",     "#"}};
+// Alternative tokens such as `and` are spelled like identifiers, so
+// classify_identifier is what turns them into operators
+constexpr std::array<std::string_view, 58> operators = {
+    {"<=>", ">>=", "<<=", "->*", "->", "%:%:", "%:", "%>", "<%", ":>",
+     "<:",  "##",  "--",  "++",  "&&", "||",   "!=", "==", "^=", "&=",
+     "|=",  "<<",  ">>",  "%=",  "/=", "*=",   ".*", ">=", "<=", "-=",
+     "+=",  "...", "^",   "&",   "|",  "%",    "/",  "*",  "?",  ",",
+     "-",   "+",   "!",   "~",   "::", ".",    ":",  ";",  ")",  "=",
+     "<",   ">",   "(",   "]",   "[",  "}",    "{",  "#"}};
 
 constexpr auto read_operator_or_punctuator(std::string_view val)
     -> std::optional<std::string> {
@@ -194,6 +204,13 @@ struct Identifier {
 
 std::ostream &operator<<(std::ostream &os, const Identifier &dt);
 
+struct Keyword {
+  std::string value;
+  Position position;
+};
+
+std::ostream &operator<<(std::ostream &os, const Keyword &dt);
+
 struct PPNumber {
   std::string value;
   Position position;
@@ -209,26 +226,123 @@ struct OperatorOrPunctuator {
 std::ostream &operator<<(std::ostream &os, const OperatorOrPunctuator &dt);
 
 using PreProcessorToken =
-    std::variant<RawPreprocessorToken, NewLine, Identifier, PPNumber,
+    std::variant<RawPreprocessorToken, NewLine, Identifier, Keyword, PPNumber,
                  OperatorOrPunctuator, StringLiteral>;
 
 std::ostream &operator<<(std::ostream &os, const PreProcessorToken &dt);
 
+// Keywords and alternative tokens such as `and` are spelled like identifiers
+// and only told apart by looking them up
+auto classify_identifier(std::string value, Position position)
+    -> PreProcessorToken;
+
+auto token_spelling(PreProcessorToken const &token) -> std::string;
+auto token_position(PreProcessorToken const &token) -> Position;
+auto set_token_position(PreProcessorToken &token, Position position) -> void;
+
+struct FoldingRange {
+  std::uint32_t start_line;
+  std::uint32_t end_line;
+};
+
+// The tokens of a buffer along with which brackets pair up, worked out while
+// lexing so bracket matching and folding never walk the tokens again. `(`,
+// `[` and `{` and their digraphs count as brackets, and a closing bracket
+// only closes the innermost open one, and only if it is of the same kind.
+struct TokenStream {
+  static constexpr std::uint32_t unmatched =
+      std::numeric_limits<std::uint32_t>::max();
+
+  std::vector<PreProcessorToken> tokens;
+  // Indexed like `tokens`, the index of the other half of each bracket pair
+  // and `unmatched` for every other token
+  std::vector<std::uint32_t> brackets;
+  // Open brackets, innermost last
+  std::vector<std::uint32_t> open_brackets;
+  // Closing brackets seen while nothing was open, which brackets lexed
+  // before this stream may still close
+  std::vector<std::uint32_t> unopened_brackets;
+
+  auto push(PreProcessorToken token) -> void;
+  // Appends a stream lexed from where this one ends, closing its unopened
+  // brackets with the brackets left open here
+  auto append(TokenStream &&other) -> void;
+
+  auto matching_bracket(std::size_t token) const -> std::optional<std::size_t>;
+  // The last token starting at or before `position`
+  auto token_at(Position position) const -> std::optional<std::size_t>;
+  // Bracket pairs spanning lines, ordered by where they open so enclosing
+  // ranges come first
+  auto folding_ranges() const -> std::vector<FoldingRange>;
+
+private:
+  auto close(std::uint32_t token) -> void;
+};
+
+// Where a comment sits in the source, without a copy of its text
+struct Trivia {
+  std::size_t offset;
+  std::size_t length;
+};
+
+enum class CommentMode { Discard, Retain };
+
 class Lexer {
 public:
   Lexer(std::filesystem::path const &path);
+  // Lexes `source` as the content of `path`, e.g. an unsaved editor buffer
+  Lexer(std::filesystem::path const &path, std::string source);
 
   auto get_next_token() -> std::optional<PreProcessorToken>;
 
   auto get_raw_token() -> std::optional<PreProcessorToken>;
 
+  // Lexes from here to the end of the buffer, giving the same tokens as
+  // calling get_next_token until it returns nothing. Buffers of more than one
+  // chunk are split at newlines and the chunks lexed in parallel.
+  auto get_all_tokens(std::size_t threads = std::thread::hardware_concurrency(),
+                      std::size_t chunk_size = 1 << 20) -> TokenStream;
+
   auto print() -> void;
 
+  // Comments are always skipped like whitespace. With CommentMode::Retain the
+  // span of every comment lexed from then on is also kept, for hover
+  // documentation and folding ranges.
+  auto set_comment_mode(CommentMode mode) -> void;
+  auto comments() const -> std::vector<Trivia> const &;
+
+  auto position() const -> Position;
+  auto offset() const -> std::size_t;
+  auto file() const -> std::filesystem::path const &;
+  auto contents() const -> std::string_view;
+  // Where the source stops being valid UTF-8, checked once on construction
+  auto invalid_utf8() const -> std::optional<Position>;
+
+  // Continues lexing from a line start reached earlier with the same source
+  auto seek(std::size_t offset, Position position) -> void;
+
+  // Moves from the start of a line to the start of the next line whose first
+  // non blank character is '#', without building tokens for anything in
+  // between. Returns false if the end of the file was reached instead.
+  auto skip_to_directive() -> bool;
+
 private:
+  // Lexes until the end of a line at or past `limit`, or of the buffer
+  auto lex_until(std::size_t limit, TokenStream &tokens) -> void;
   auto parse_string_literal() -> std::optional<StringLiteral>;
+  // Skips the comment starting at the cursor, if there is one
+  auto skip_comment() -> bool;
+  auto get(char &c) -> bool;
+  auto putback() -> void;
 
   std::filesystem::path path;
-  std::ifstream istream;
+  // Shared with the lexers that lex chunks of it in parallel
+  std::shared_ptr<std::string const> source;
+  std::string_view text;
+  std::optional<std::size_t> invalid_utf8_offset;
+  std::size_t cursor{};
   Position pos{};
   std::optional<PreProcessorToken> token_buffer;
+  CommentMode comment_mode{CommentMode::Discard};
+  std::vector<Trivia> comment_spans;
 };
@@ -0,0 +1,1501 @@
+#include "preprocessor.h"
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <iterator>
+#include <limits>
+
+namespace {
+auto is_punctuator(PreProcessorToken const &token, std::string_view value)
+    -> bool {
+  auto *punctuator = std::get_if<OperatorOrPunctuator>(&token);
+  return punctuator != nullptr && punctuator->value == value;
+}
+
+auto is_hash(PreProcessorToken const &token) -> bool {
+  return is_punctuator(token, "#") || is_punctuator(token, "%:");
+}
+
+auto is_paste(PreProcessorToken const &token) -> bool {
+  return is_punctuator(token, "##") || is_punctuator(token, "%:%:");
+}
+
+// Keywords are still identifiers to the preprocessor: they name directives
+// like #if and may be defined as macros
+auto identifier_name(PreProcessorToken const &token)
+    -> std::optional<std::string_view> {
+  if (auto *identifier = std::get_if<Identifier>(&token)) {
+    return identifier->value;
+  }
+  if (auto *keyword = std::get_if<Keyword>(&token)) {
+    return keyword->value;
+  }
+  return {};
+}
+
+auto end_of(PreProcessorToken const &token) -> Position {
+  auto position = token_position(token);
+  position.character += token_spelling(token).size();
+  return position;
+}
+
+auto directly_follows(PreProcessorToken const &first,
+                      PreProcessorToken const &second) -> bool {
+  auto end = end_of(first);
+  auto begin = token_position(second);
+  return end.line_number == begin.line_number &&
+         end.character == begin.character;
+}
+
+auto add_to_hide_set(std::vector<Symbol> &hide_set, Symbol symbol) -> void {
+  auto found = std::lower_bound(hide_set.begin(), hide_set.end(), symbol);
+  if (found == hide_set.end() || *found != symbol) {
+    hide_set.insert(found, symbol);
+  }
+}
+
+auto merge_hide_set(std::vector<Symbol> &hide_set,
+                    std::vector<Symbol> const &other) -> void {
+  std::vector<Symbol> merged;
+  merged.reserve(hide_set.size() + other.size());
+  std::set_union(hide_set.begin(), hide_set.end(), other.begin(), other.end(),
+                 std::back_inserter(merged));
+  hide_set = std::move(merged);
+}
+
+// Turns the spelling produced by ## back into a single token, if it forms one
+auto lex_spelling(std::string const &spelling, Position position)
+    -> std::optional<PreProcessorToken> {
+  if (auto identifier = read_identifier(spelling.begin(), spelling.end());
+      identifier.has_value() && identifier->size() == spelling.size()) {
+    return classify_identifier(spelling, position);
+  }
+  if (auto ppnumber = read_ppnumber(spelling.begin(), spelling.end());
+      ppnumber.has_value() && ppnumber->size() == spelling.size()) {
+    return PPNumber{spelling, position};
+  }
+  if (auto punctuator = read_operator_or_punctuator(spelling);
+      punctuator.has_value() && punctuator->size() == spelling.size()) {
+    return OperatorOrPunctuator{spelling, position};
+  }
+  return {};
+}
+} // namespace
+
+Preprocessor::Preprocessor(
+    std::filesystem::path const &path,
+    std::vector<std::filesystem::path> include_directories)
+    : include_directories(std::move(include_directories)),
+      va_args(symbols.intern("__VA_ARGS__")) {
+  auto key = std::filesystem::weakly_canonical(path).string();
+  files.push_back({Lexer{path}, 0, GuardState::Start, {}, std::move(key)});
+};
+
+Preprocessor::Preprocessor(
+    std::filesystem::path const &path, std::string source,
+    std::vector<std::filesystem::path> include_directories,
+    std::shared_ptr<Preamble const> preamble)
+    : include_directories(std::move(include_directories)),
+      va_args(symbols.intern("__VA_ARGS__")) {
+  auto key = std::filesystem::weakly_canonical(path).string();
+  auto reuse = preamble != nullptr &&
+               preamble->is_valid_for(source, this->include_directories);
+  files.push_back({Lexer{path, std::move(source)}, 0, GuardState::Start, {},
+                   std::move(key)});
+  if (reuse) {
+    restore_preamble(*preamble);
+    preamble_snapshot = std::move(preamble);
+  } else {
+    recording_preamble = true;
+  }
+};
+
+auto Preprocessor::preamble() const -> std::shared_ptr<Preamble const> {
+  return preamble_snapshot;
+}
+
+auto Preprocessor::Preamble::is_valid_for(
+    std::string_view source,
+    std::vector<std::filesystem::path> const &include_directories) const
+    -> bool {
+  if (!source.starts_with(text) ||
+      include_directories != this->include_directories) {
+    return false;
+  }
+  return std::all_of(
+      dependencies.begin(), dependencies.end(), [](auto const &dependency) {
+        std::error_code error;
+        if (!dependency.exists) {
+          return !std::filesystem::exists(dependency.path, error) && !error;
+        }
+        auto modified =
+            std::filesystem::last_write_time(dependency.path, error);
+        if (error || modified != dependency.modified) {
+          return false;
+        }
+        auto size = std::filesystem::file_size(dependency.path, error);
+        return !error && size == dependency.size;
+      });
+}
+
+auto Preprocessor::capture_preamble() -> void {
+  recording_preamble = false;
+  auto preamble = std::make_shared<Preamble>();
+  preamble->text = lexer().contents().substr(0, preamble_end.offset);
+  preamble->end = preamble_end.position;
+  preamble->tokens = std::move(preamble_tokens);
+  for (auto &path : preamble_dependencies) {
+    std::error_code error;
+    auto modified = std::filesystem::last_write_time(path, error);
+    auto size = std::filesystem::file_size(path, error);
+    if (error) {
+      // Without a timestamp we could never tell if the snapshot is stale
+      return;
+    }
+    preamble->dependencies.push_back(
+        {std::move(path), true, modified, size});
+  }
+  for (auto &path : preamble_misses) {
+    preamble->dependencies.push_back({std::move(path), false, {}, 0});
+  }
+  preamble->include_directories = include_directories;
+  preamble->symbols = symbols;
+  preamble->macros = macros;
+  preamble->conditionals = conditionals;
+  preamble->inactive = inactive;
+  preamble->problems = problems;
+  preamble->guard_state = files.front().guard_state;
+  preamble->guard = files.front().guard;
+  preamble->include_info = include_info;
+  preamble->resolved = resolved;
+  preamble_snapshot = std::move(preamble);
+}
+
+auto Preprocessor::restore_preamble(Preamble const &preamble) -> void {
+  symbols = preamble.symbols;
+  macros = preamble.macros;
+  conditionals = preamble.conditionals;
+  inactive = preamble.inactive;
+  problems = preamble.problems;
+  files.front().guard_state = preamble.guard_state;
+  files.front().guard = preamble.guard;
+  include_info = preamble.include_info;
+  resolved = preamble.resolved;
+  // Tokens of the preamble were fully expanded when they were recorded
+  for (auto const &token : preamble.tokens) {
+    pending.push_back({token, {}, false});
+  }
+  lexer().seek(preamble.text.size(), preamble.end);
+}
+
+auto Preprocessor::get_next_token() -> std::optional<PreProcessorToken> {
+  auto token = expand_next(pending, true);
+  if (!token.has_value()) {
+    return {};
+  }
+  if (recording_preamble) {
+    preamble_tokens.push_back(token->token);
+  }
+  return std::move(token->token);
+}
+
+auto Preprocessor::is_defined(std::string_view name) const -> bool {
+  auto symbol = symbols.find(name);
+  return symbol.has_value() && *symbol < macros.size() &&
+         macros[*symbol].has_value();
+}
+
+auto Preprocessor::diagnostics() const -> std::vector<Diagnostic> const & {
+  return problems;
+}
+
+auto Preprocessor::inactive_regions() const
+    -> std::vector<SourceRange> const & {
+  return inactive;
+}
+
+auto Preprocessor::next_raw(TokenQueue &input, bool from_lexer)
+    -> std::optional<ExpandedToken> {
+  if (!input.empty()) {
+    auto token = std::move(input.front());
+    input.pop_front();
+    return token;
+  }
+  if (!from_lexer) {
+    return {};
+  }
+  return read_lexer_token();
+}
+
+auto Preprocessor::read_lexer_token() -> std::optional<ExpandedToken> {
+  while (true) {
+    auto in_preamble = recording_preamble && files.size() == 1;
+    if (in_preamble && at_line_start) {
+      preamble_end = {lexer().offset(), lexer().position()};
+    }
+    auto token = lexer().get_next_token();
+    if (!token.has_value()) {
+      auto main_file = files.size() == 1;
+      if (main_file && recording_preamble) {
+        // Conditionals still open may be closed by whatever is typed next, so
+        // they go into the snapshot before finish_file drops them. Skipping
+        // lines cannot be resumed from a snapshot, so none is taken then.
+        if (skipped_to_end) {
+          recording_preamble = false;
+        } else {
+          preamble_end = {lexer().offset(), lexer().position()};
+          capture_preamble();
+        }
+      }
+      finish_file();
+      if (main_file) {
+        return {};
+      }
+      continue;
+    }
+    if (std::holds_alternative<NewLine>(*token)) {
+      at_line_start = true;
+      return ExpandedToken{std::move(*token)};
+    }
+    if (!at_line_start || !is_hash(*token)) {
+      if (in_preamble) {
+        // The first line that is not a directive ends the preamble
+        capture_preamble();
+      }
+      at_line_start = false;
+      if (files.back().guard_state != GuardState::InGuard) {
+        files.back().guard_state = GuardState::NotGuarded;
+      }
+      return ExpandedToken{std::move(*token)};
+    }
+
+    std::vector<PreProcessorToken> line{std::move(*token)};
+    auto newline = read_line(line);
+
+    if (handle_directive(line)) {
+      if (!newline.has_value()) {
+        return {};
+      }
+      return ExpandedToken{std::move(*newline)};
+    }
+
+    // Directives we do not act on are handed on untouched
+    if (newline.has_value()) {
+      line.push_back(std::move(*newline));
+    }
+    for (auto &directive_token : line) {
+      pending.push_back(ExpandedToken{std::move(directive_token), {}, false});
+    }
+    auto first = std::move(pending.front());
+    pending.pop_front();
+    return first;
+  }
+}
+
+auto Preprocessor::expand_next(TokenQueue &input, bool from_lexer)
+    -> std::optional<ExpandedToken> {
+  while (true) {
+    auto token = next_raw(input, from_lexer);
+    if (!token.has_value()) {
+      return {};
+    }
+    auto symbol = macro_to_expand(*token);
+    if (!symbol.has_value()) {
+      return token;
+    }
+
+    std::vector<ExpandedToken> expansion;
+    if (macros[*symbol]->function_like) {
+      auto arguments = collect_arguments(*macros[*symbol], input, from_lexer);
+      if (!arguments.has_value()) {
+        return token;
+      }
+      expansion = expand_function_like(*symbol, *token, *arguments);
+    } else {
+      expansion = expand_object_like(*symbol, *token);
+    }
+
+    auto position = token_position(token->token);
+    for (auto &expanded : expansion) {
+      set_token_position(expanded.token, position);
+    }
+    input.insert(input.begin(), std::make_move_iterator(expansion.begin()),
+                 std::make_move_iterator(expansion.end()));
+  }
+}
+
+auto Preprocessor::expand_all(std::vector<ExpandedToken> const &tokens)
+    -> std::vector<ExpandedToken> {
+  TokenQueue input(tokens.begin(), tokens.end());
+  std::vector<ExpandedToken> result;
+  while (auto token = expand_next(input, false)) {
+    result.push_back(std::move(*token));
+  }
+  return result;
+}
+
+auto Preprocessor::macro_to_expand(ExpandedToken const &token) const
+    -> std::optional<Symbol> {
+  if (!token.expandable) {
+    return {};
+  }
+  auto name = identifier_name(token.token);
+  if (!name.has_value()) {
+    return {};
+  }
+  auto symbol = symbols.find(*name);
+  if (!symbol.has_value() || *symbol >= macros.size() ||
+      !macros[*symbol].has_value()) {
+    return {};
+  }
+  if (std::binary_search(token.hide_set.begin(), token.hide_set.end(),
+                         *symbol)) {
+    return {};
+  }
+  return symbol;
+}
+
+auto Preprocessor::collect_arguments(Macro const &macro, TokenQueue &input,
+                                     bool from_lexer)
+    -> std::optional<Arguments> {
+  // A directive inside the arguments may redefine the macro, so take what we
+  // need up front
+  auto parameters = macro.parameters.size();
+  auto variadic = macro.variadic;
+
+  std::vector<ExpandedToken> consumed;
+  auto restore = [&]() {
+    input.insert(input.begin(), std::make_move_iterator(consumed.begin()),
+                 std::make_move_iterator(consumed.end()));
+  };
+
+  while (true) {
+    auto token = next_raw(input, from_lexer);
+    if (!token.has_value()) {
+      restore();
+      return {};
+    }
+    auto newline = std::holds_alternative<NewLine>(token->token);
+    auto open = is_punctuator(token->token, "(");
+    consumed.push_back(std::move(*token));
+    if (open) {
+      break;
+    }
+    if (!newline) {
+      restore();
+      return {};
+    }
+  }
+
+  Arguments arguments(1);
+  std::size_t depth = 0;
+  while (true) {
+    auto token = next_raw(input, from_lexer);
+    if (!token.has_value()) {
+      // Arguments may continue after an expansion, which rescanning it
+      // together with the rest of the input will pick up
+      if (from_lexer) {
+        report(token_position(consumed.front().token),
+               "Unterminated macro invocation");
+      }
+      restore();
+      return {};
+    }
+    consumed.push_back(*token);
+    if (std::holds_alternative<NewLine>(token->token)) {
+      continue;
+    }
+    if (is_punctuator(token->token, "(")) {
+      depth++;
+    } else if (is_punctuator(token->token, ")")) {
+      if (depth == 0) {
+        break;
+      }
+      depth--;
+    } else if (depth == 0 && is_punctuator(token->token, ",") &&
+               !(variadic && arguments.size() == parameters)) {
+      arguments.emplace_back();
+      continue;
+    }
+    arguments.back().push_back(std::move(*token));
+  }
+
+  if (parameters == 0 && arguments.size() == 1 && arguments.front().empty()) {
+    arguments.clear();
+  }
+  if (variadic && arguments.size() + 1 == parameters) {
+    arguments.emplace_back();
+  }
+  if (arguments.size() != parameters) {
+    report(token_position(consumed.front().token),
+           "Macro expects " + std::to_string(parameters) +
+               " arguments but got " + std::to_string(arguments.size()));
+    restore();
+    return {};
+  }
+  return arguments;
+}
+
+auto Preprocessor::expand_object_like(Symbol symbol, ExpandedToken const &name)
+    -> std::vector<ExpandedToken> {
+  // Only expansions that start from a clean hide set are context free
+  auto cacheable = name.hide_set.empty();
+  if (cacheable) {
+    auto cached = object_like_cache.find(symbol);
+    if (cached != object_like_cache.end()) {
+      return cached->second;
+    }
+  }
+
+  auto body = substitute(*macros[symbol], {});
+  auto hide_set = name.hide_set;
+  add_to_hide_set(hide_set, symbol);
+  for (auto &token : body) {
+    merge_hide_set(token.hide_set, hide_set);
+  }
+  auto expansion = expand_all(body);
+
+  if (cacheable) {
+    object_like_cache.emplace(symbol, expansion);
+  }
+  return expansion;
+}
+
+auto Preprocessor::expand_function_like(Symbol symbol,
+                                        ExpandedToken const &name,
+                                        Arguments const &arguments)
+    -> std::vector<ExpandedToken> {
+  auto cacheable =
+      name.hide_set.empty() &&
+      std::all_of(arguments.begin(), arguments.end(), [](auto &argument) {
+        return std::all_of(argument.begin(), argument.end(), [](auto &token) {
+          return token.hide_set.empty() && token.expandable;
+        });
+      });
+
+  std::string key;
+  if (cacheable) {
+    // Whitespace between tokens is part of the key since # can observe it
+    key = std::to_string(symbol);
+    for (auto const &argument : arguments) {
+      key += '\x1f';
+      for (auto it = argument.begin(); it != argument.end(); it++) {
+        if (it != argument.begin()) {
+          key += directly_follows((it - 1)->token, it->token) ? '\x1e' : ' ';
+        }
+        key += token_spelling(it->token);
+      }
+    }
+    auto cached = function_like_cache.find(key);
+    if (cached != function_like_cache.end()) {
+      return cached->second;
+    }
+  }
+
+  if (!macros[symbol].has_value()) {
+    report(token_position(name.token),
+           "Macro " + std::string{symbols.name(symbol)} +
+               " was undefined inside its own arguments");
+    return {name};
+  }
+  auto body = substitute(*macros[symbol], arguments);
+  auto hide_set = name.hide_set;
+  add_to_hide_set(hide_set, symbol);
+  for (auto &token : body) {
+    merge_hide_set(token.hide_set, hide_set);
+  }
+  auto expansion = expand_all(body);
+
+  if (cacheable) {
+    function_like_cache.emplace(std::move(key), expansion);
+  }
+  return expansion;
+}
+
+namespace {
+auto stringize(std::vector<PreProcessorToken> const &tokens, Position position)
+    -> PreProcessorToken {
+  std::string value{"\""};
+  for (auto it = tokens.begin(); it != tokens.end(); it++) {
+    if (it != tokens.begin() && !directly_follows(*(it - 1), *it)) {
+      value += ' ';
+    }
+    auto spelling = token_spelling(*it);
+    auto literal = std::holds_alternative<StringLiteral>(*it) ||
+                   (!spelling.empty() && spelling.front() == '\'');
+    for (auto c : spelling) {
+      if (literal && (c == '\"' || c == '\\')) {
+        value += '\\';
+      }
+      value += c;
+    }
+  }
+  value += '\"';
+  return StringLiteral{{}, std::move(value), {}, position};
+}
+} // namespace
+
+auto Preprocessor::substitute(Macro const &macro, Arguments const &arguments)
+    -> std::vector<ExpandedToken> {
+  auto const &replacement = macro.replacement;
+  std::vector<ExpandedToken> result;
+  // Arguments are fully expanded on their own before being substituted, but
+  // only when they are actually used that way
+  std::vector<std::optional<std::vector<ExpandedToken>>> expanded(
+      arguments.size());
+  auto append = [&](std::vector<ExpandedToken> const &tokens) {
+    result.insert(result.end(), tokens.begin(), tokens.end());
+  };
+  // Whether the left operand of a following ## was an empty argument
+  bool placemarker = false;
+
+  for (std::size_t i = 0; i < replacement.size(); i++) {
+    auto const &current = replacement[i];
+    auto has_next = i + 1 < replacement.size();
+
+    if (macro.function_like && is_hash(current.token) && has_next &&
+        replacement[i + 1].parameter.has_value()) {
+      std::vector<PreProcessorToken> spelled;
+      for (auto const &token : arguments[*replacement[i + 1].parameter]) {
+        spelled.push_back(token.token);
+      }
+      result.push_back({stringize(spelled, token_position(current.token))});
+      placemarker = false;
+      i++;
+      continue;
+    }
+
+    if (is_paste(current.token) && has_next) {
+      auto const &next = replacement[i + 1];
+      i++;
+      std::vector<ExpandedToken> operand;
+      if (next.parameter.has_value()) {
+        operand = arguments[*next.parameter];
+      } else {
+        operand.push_back({next.token});
+      }
+
+      // GNU extension: `, ## __VA_ARGS__` drops the comma when there are no
+      // variadic arguments
+      if (macro.variadic && next.parameter == macro.parameters.size() - 1 &&
+          !placemarker && !result.empty() &&
+          is_punctuator(result.back().token, ",")) {
+        if (operand.empty()) {
+          result.pop_back();
+        }
+        append(operand);
+        continue;
+      }
+
+      if (placemarker || result.empty()) {
+        append(operand);
+        placemarker = operand.empty();
+        continue;
+      }
+      if (!operand.empty()) {
+        auto &left = result.back().token;
+        auto spelling =
+            token_spelling(left) + token_spelling(operand.front().token);
+        auto pasted = lex_spelling(spelling, token_position(left));
+        if (!pasted.has_value()) {
+          report(token_position(left),
+                 "Pasting did not give a valid preprocessing token: " +
+                     spelling);
+          pasted = RawPreprocessorToken{spelling, token_position(left)};
+        }
+        left = std::move(*pasted);
+        result.insert(result.end(), operand.begin() + 1, operand.end());
+      }
+      placemarker = false;
+      continue;
+    }
+
+    if (current.parameter.has_value()) {
+      auto parameter = *current.parameter;
+      if (has_next && is_paste(replacement[i + 1].token)) {
+        append(arguments[parameter]);
+        placemarker = arguments[parameter].empty();
+      } else {
+        if (!expanded[parameter].has_value()) {
+          expanded[parameter] = expand_all(arguments[parameter]);
+        }
+        append(*expanded[parameter]);
+        placemarker = false;
+      }
+      continue;
+    }
+
+    result.push_back({current.token});
+    placemarker = false;
+  }
+  return result;
+}
+
+auto Preprocessor::report(Position position, std::string message) -> void {
+  problems.push_back({lexer().file(), position, std::move(message)});
+}
+
+auto Preprocessor::lexer() -> Lexer & { return files.back().lexer; }
+
+auto Preprocessor::finish_file() -> void {
+  auto &file = files.back();
+  if (conditionals.size() > file.conditional_base) {
+    report(file.lexer.position(), "Unterminated conditional directive");
+    conditionals.resize(file.conditional_base);
+  }
+  if (file.guard_state == GuardState::AfterGuard) {
+    include_info[file.key].guard = file.guard;
+  }
+  if (files.size() > 1) {
+    files.pop_back();
+    at_line_start = true;
+  }
+}
+
+auto Preprocessor::include(std::vector<PreProcessorToken> const &line)
+    -> void {
+  std::vector<PreProcessorToken> operand(line.begin() + 2, line.end());
+  if (!operand.empty() && !std::holds_alternative<StringLiteral>(operand[0]) &&
+      !is_punctuator(operand[0], "<")) {
+    // #include pp-tokens, the header name comes from macro expansion
+    std::vector<ExpandedToken> tokens;
+    for (auto &token : operand) {
+      tokens.push_back({std::move(token)});
+    }
+    operand.clear();
+    for (auto &token : expand_all(tokens)) {
+      operand.push_back(std::move(token.token));
+    }
+  }
+
+  std::string name;
+  auto quoted = false;
+  if (!operand.empty() && std::holds_alternative<StringLiteral>(operand[0])) {
+    auto const &literal = std::get<StringLiteral>(operand[0]).raw_token;
+    name = literal.substr(1, literal.size() - 2);
+    quoted = true;
+  } else if (!operand.empty() && is_punctuator(operand[0], "<")) {
+    auto it = operand.begin() + 1;
+    for (; it != operand.end() && !is_punctuator(*it, ">"); it++) {
+      if (it != operand.begin() + 1 && !directly_follows(*(it - 1), *it)) {
+        name += ' ';
+      }
+      name += token_spelling(*it);
+    }
+    if (it == operand.end()) {
+      name.clear();
+    }
+  }
+  if (name.empty()) {
+    report(token_position(line[1]), "Invalid #include");
+    return;
+  }
+
+  auto path = resolve_include(name, quoted);
+  if (!path.has_value()) {
+    report(token_position(line[1]), "Could not find include " + name);
+    return;
+  }
+  // Multiple include optimization: a header we already know to be guarded
+  // is skipped without being opened again
+  auto info = include_info.find(*path);
+  if (info != include_info.end()) {
+    if (info->second.pragma_once) {
+      return;
+    }
+    if (info->second.guard.has_value() && *info->second.guard < macros.size() &&
+        macros[*info->second.guard].has_value()) {
+      return;
+    }
+  }
+  if (files.size() >= 200) {
+    report(token_position(line[1]), "#include nested too deeply at " + *path);
+    return;
+  }
+  if (recording_preamble) {
+    preamble_dependencies.push_back(*path);
+  }
+  files.push_back(
+      {Lexer{*path}, conditionals.size(), GuardState::Start, {}, *path});
+  at_line_start = true;
+}
+
+auto Preprocessor::resolve_include(std::string const &name, bool quoted)
+    -> std::optional<std::string> {
+  auto directory = lexer().file().parent_path();
+  auto key = (quoted ? directory.string() : std::string{}) + '\0' + name;
+  auto found = resolved.find(key);
+  if (found != resolved.end()) {
+    return found->second;
+  }
+
+  std::optional<std::string> result;
+  auto try_directory = [&](std::filesystem::path const &base) {
+    auto candidate = base / name;
+    std::error_code error;
+    if (std::filesystem::is_regular_file(candidate, error)) {
+      result = std::filesystem::weakly_canonical(candidate, error).string();
+      return true;
+    }
+    // Creating the header later changes what the preamble means
+    if (recording_preamble) {
+      preamble_misses.push_back(std::move(candidate));
+    }
+    return false;
+  };
+  if (!quoted || !try_directory(directory)) {
+    for (auto const &include_directory : include_directories) {
+      if (try_directory(include_directory)) {
+        break;
+      }
+    }
+  }
+  resolved.emplace(std::move(key), result);
+  return result;
+}
+
+auto Preprocessor::guard_macro(std::vector<PreProcessorToken> const &line) const
+    -> std::optional<std::string_view> {
+  auto name = identifier_name(line[1]);
+  if (name == "ifndef" && line.size() == 3) {
+    return identifier_name(line[2]);
+  }
+  // #if !defined X and #if !defined(X)
+  if (name != "if" || line.size() < 5 || !is_punctuator(line[2], "!") ||
+      identifier_name(line[3]) != "defined") {
+    return {};
+  }
+  if (line.size() == 5) {
+    return identifier_name(line[4]);
+  }
+  if (line.size() == 7 && is_punctuator(line[4], "(") &&
+      is_punctuator(line[6], ")")) {
+    return identifier_name(line[5]);
+  }
+  return {};
+}
+
+auto Preprocessor::on_directive(std::string_view name,
+                                std::vector<PreProcessorToken> const &line)
+    -> void {
+  auto &file = files.back();
+  if (file.guard_state == GuardState::Start) {
+    auto guard = guard_macro(line);
+    if (guard.has_value()) {
+      file.guard_state = GuardState::InGuard;
+      file.guard = symbols.intern(*guard);
+      return;
+    }
+  }
+  if (file.guard_state == GuardState::InGuard) {
+    // The guard must cover the whole file, an #else would make it partial
+    if ((name == "else" || name == "elif") &&
+        conditionals.size() == file.conditional_base + 1) {
+      file.guard_state = GuardState::NotGuarded;
+    }
+    return;
+  }
+  file.guard_state = GuardState::NotGuarded;
+}
+
+auto Preprocessor::on_conditional_closed() -> void {
+  auto &file = files.back();
+  if (file.guard_state == GuardState::InGuard &&
+      conditionals.size() == file.conditional_base) {
+    file.guard_state = GuardState::AfterGuard;
+  }
+}
+
+auto Preprocessor::read_line(std::vector<PreProcessorToken> &line)
+    -> std::optional<PreProcessorToken> {
+  while (auto token = lexer().get_next_token()) {
+    if (std::holds_alternative<NewLine>(*token)) {
+      return token;
+    }
+    line.push_back(std::move(*token));
+  }
+  return {};
+}
+
+auto Preprocessor::handle_directive(std::vector<PreProcessorToken> const &line)
+    -> bool {
+  if (line.size() == 1) {
+    return true;
+  }
+  auto name = identifier_name(line[1]);
+  if (!name.has_value()) {
+    return false;
+  }
+  on_directive(*name, line);
+  if (*name == "if" || *name == "ifdef" || *name == "ifndef") {
+    bool taken;
+    if (*name == "if") {
+      taken = evaluate(line, 2);
+    } else {
+      auto macro = line.size() > 2 ? identifier_name(line[2])
+                                   : std::optional<std::string_view>{};
+      if (!macro.has_value()) {
+        report(token_position(line[1]),
+               "Missing macro name in #" + std::string{*name});
+      }
+      taken = macro.has_value() && is_defined(*macro) == (*name == "ifdef");
+    }
+    conditionals.push_back({taken});
+    if (!taken) {
+      skip_inactive_branch();
+    }
+    return true;
+  }
+  if (*name == "elif" || *name == "else") {
+    if (conditionals.empty()) {
+      report(token_position(line[1]), "#" + std::string{*name} + " without #if");
+      return true;
+    }
+    // We only get here from an active branch, so every later one is inactive
+    skip_inactive_branch();
+    return true;
+  }
+  if (*name == "endif") {
+    if (conditionals.empty()) {
+      report(token_position(line[1]), "#endif without #if");
+      return true;
+    }
+    conditionals.pop_back();
+    on_conditional_closed();
+    return true;
+  }
+  if (*name == "include") {
+    include(line);
+    return true;
+  }
+  if (*name == "pragma" && line.size() == 3 &&
+      identifier_name(line[2]) == "once") {
+    include_info[files.back().key].pragma_once = true;
+    return true;
+  }
+  if (*name == "define") {
+    define(line);
+    return true;
+  }
+  if (*name == "undef") {
+    undef(line);
+    return true;
+  }
+  return false;
+}
+
+auto Preprocessor::define(std::vector<PreProcessorToken> const &line) -> void {
+  auto name = line.size() > 2 ? identifier_name(line[2])
+                              : std::optional<std::string_view>{};
+  if (!name.has_value()) {
+    report(token_position(line[1]), "Missing macro name in #define");
+    return;
+  }
+
+  Macro macro;
+  std::size_t index = 3;
+  if (index < line.size() && is_punctuator(line[index], "(") &&
+      directly_follows(line[2], line[index])) {
+    macro.function_like = true;
+    auto closed = false;
+    for (index++; index < line.size(); index++) {
+      auto const &token = line[index];
+      if (is_punctuator(token, ")")) {
+        closed = true;
+        index++;
+        break;
+      }
+      if (is_punctuator(token, ",")) {
+        continue;
+      }
+      if (is_punctuator(token, "...")) {
+        macro.variadic = true;
+        macro.parameters.push_back(va_args);
+        continue;
+      }
+      if (auto parameter = identifier_name(token)) {
+        macro.parameters.push_back(symbols.intern(*parameter));
+        // GNU extension: named variadic parameter `args...`
+        if (index + 1 < line.size() && is_punctuator(line[index + 1], "...")) {
+          macro.variadic = true;
+          index++;
+        }
+        continue;
+      }
+      report(token_position(token),
+             "Invalid macro parameter " + token_spelling(token));
+      return;
+    }
+    if (!closed) {
+      report(token_position(line[2]),
+             "Missing ')' in macro parameter list of " + std::string{*name});
+      return;
+    }
+  }
+
+  for (; index < line.size(); index++) {
+    std::optional<std::size_t> parameter;
+    auto identifier = identifier_name(line[index]);
+    if (macro.function_like && identifier.has_value()) {
+      auto symbol = symbols.find(*identifier);
+      auto found = std::find(macro.parameters.begin(), macro.parameters.end(),
+                             symbol.value_or(symbols.size()));
+      if (found != macro.parameters.end()) {
+        parameter = std::distance(macro.parameters.begin(), found);
+      }
+    }
+    macro.replacement.push_back({line[index], parameter});
+  }
+
+  auto symbol = symbols.intern(*name);
+  if (macros.size() <= symbol) {
+    macros.resize(symbols.size());
+  }
+  macros[symbol] = std::move(macro);
+  invalidate_expansions();
+}
+
+auto Preprocessor::undef(std::vector<PreProcessorToken> const &line) -> void {
+  auto name = line.size() > 2 ? identifier_name(line[2])
+                              : std::optional<std::string_view>{};
+  if (!name.has_value()) {
+    report(token_position(line[1]), "Missing macro name in #undef");
+    return;
+  }
+  auto symbol = symbols.find(*name);
+  if (symbol.has_value() && *symbol < macros.size()) {
+    macros[*symbol].reset();
+    invalidate_expansions();
+  }
+}
+
+auto Preprocessor::invalidate_expansions() -> void {
+  object_like_cache.clear();
+  function_like_cache.clear();
+}
+
+namespace {
+// Evaluates the controlling expression of #if and #elif once `defined` and
+// macros have been replaced
+class ConditionParser {
+public:
+  explicit ConditionParser(std::vector<PreProcessorToken> const &line) {
+    for (auto const &token : line) {
+      add(token);
+    }
+  }
+
+  auto parse() -> std::optional<std::intmax_t> {
+    auto value = conditional();
+    if (!value.has_value() || index != tokens.size()) {
+      return {};
+    }
+    return static_cast<std::intmax_t>(value->bits);
+  }
+
+private:
+  // Every signed integer type acts as intmax_t and every unsigned one as
+  // uintmax_t (C++ [cpp.cond]). Arithmetic is done on the bits, which wraps
+  // around as it does in compilers, where signed overflow would be undefined.
+  struct Value {
+    std::uintmax_t bits;
+    bool is_unsigned{false};
+  };
+
+  static auto signed_value(Value value) -> std::intmax_t {
+    return static_cast<std::intmax_t>(value.bits);
+  }
+
+  static auto truth(bool value) -> Value { return {value ? 1u : 0u}; }
+
+  // Character literals come out of the lexer as raw text running on to the
+  // next space, with any encoding prefix as an identifier before them, so
+  // the literal is split off and the rest lexed again
+  auto add(PreProcessorToken token) -> void {
+    auto *raw = std::get_if<RawPreprocessorToken>(&token);
+    if (raw == nullptr || !raw->raw_token.starts_with('\'')) {
+      constexpr std::array<std::pair<std::string_view, std::string_view>, 8>
+          alternatives{{{"and", "&&"},
+                        {"or", "||"},
+                        {"not", "!"},
+                        {"not_eq", "!="},
+                        {"bitand", "&"},
+                        {"bitor", "|"},
+                        {"xor", "^"},
+                        {"compl", "~"}}};
+      if (auto *op = std::get_if<OperatorOrPunctuator>(&token)) {
+        for (auto [alternative, primary] : alternatives) {
+          if (op->value == alternative) {
+            op->value = primary;
+          }
+        }
+      }
+      tokens.push_back(std::move(token));
+      return;
+    }
+    auto const &text = raw->raw_token;
+    std::size_t end = 1;
+    while (end < text.size() && text[end] != '\'') {
+      end += text[end] == '\\' ? 2 : 1;
+    }
+    end = std::min(end + 1, text.size());
+    auto literal = text.substr(0, end);
+    if (!tokens.empty() && directly_follows(tokens.back(), token)) {
+      auto prefix = identifier_name(tokens.back());
+      if (prefix == "L" || prefix == "u" || prefix == "U" || prefix == "u8") {
+        literal.insert(0, *prefix);
+        tokens.pop_back();
+      }
+    }
+    auto position = raw->position;
+    auto rest = text.substr(end);
+    tokens.push_back(RawPreprocessorToken{std::move(literal), position});
+    position.character += end;
+    Lexer lexer{"", std::move(rest)};
+    while (auto next = lexer.get_next_token()) {
+      auto at = token_position(*next);
+      set_token_position(*next, {position.line_number,
+                                 position.character + at.character});
+      add(std::move(*next));
+    }
+  }
+
+  auto accept(std::string_view punctuator) -> bool {
+    if (index < tokens.size() && is_punctuator(tokens[index], punctuator)) {
+      index++;
+      return true;
+    }
+    return false;
+  }
+
+  static auto precedence(std::string_view op) -> int {
+    constexpr std::array<std::pair<std::string_view, int>, 18> table{{
+        {"||", 1}, {"&&", 2}, {"|", 3},  {"^", 4},  {"&", 5},  {"==", 6},
+        {"!=", 6}, {"<", 7},  {">", 7},  {"<=", 7}, {">=", 7}, {"<<", 8},
+        {">>", 8}, {"+", 9},  {"-", 9},  {"*", 10}, {"/", 10}, {"%", 10},
+    }};
+    for (auto [spelling, value] : table) {
+      if (spelling == op) {
+        return value;
+      }
+    }
+    return 0;
+  }
+
+  static auto apply(std::string_view op, Value left, Value right)
+      -> std::optional<Value> {
+    if (op == "||") {
+      return truth(left.bits != 0 || right.bits != 0);
+    }
+    if (op == "&&") {
+      return truth(left.bits != 0 && right.bits != 0);
+    }
+    if (op == "<<" || op == ">>") {
+      // The result has the type of the left operand, and shifting by the
+      // width of the type or more is undefined
+      if ((!right.is_unsigned && signed_value(right) < 0) ||
+          right.bits >= std::numeric_limits<std::uintmax_t>::digits) {
+        return {};
+      }
+      if (op == "<<") {
+        return Value{left.bits << right.bits, left.is_unsigned};
+      }
+      return Value{left.is_unsigned ? left.bits >> right.bits
+                                    : static_cast<std::uintmax_t>(
+                                          signed_value(left) >> right.bits),
+                   left.is_unsigned};
+    }
+    // Otherwise both operands are converted to unsigned if either is
+    auto is_unsigned = left.is_unsigned || right.is_unsigned;
+    auto less = is_unsigned ? left.bits < right.bits
+                            : signed_value(left) < signed_value(right);
+    auto greater = is_unsigned ? left.bits > right.bits
+                               : signed_value(left) > signed_value(right);
+    if (op == "==") {
+      return truth(left.bits == right.bits);
+    }
+    if (op == "!=") {
+      return truth(left.bits != right.bits);
+    }
+    if (op == "<") {
+      return truth(less);
+    }
+    if (op == ">") {
+      return truth(greater);
+    }
+    if (op == "<=") {
+      return truth(!greater);
+    }
+    if (op == ">=") {
+      return truth(!less);
+    }
+    auto result = [&](std::uintmax_t bits) -> std::optional<Value> {
+      return Value{bits, is_unsigned};
+    };
+    if (op == "|") {
+      return result(left.bits | right.bits);
+    }
+    if (op == "^") {
+      return result(left.bits ^ right.bits);
+    }
+    if (op == "&") {
+      return result(left.bits & right.bits);
+    }
+    if (op == "+") {
+      return result(left.bits + right.bits);
+    }
+    if (op == "-") {
+      return result(left.bits - right.bits);
+    }
+    if (op == "*") {
+      return result(left.bits * right.bits);
+    }
+    if (right.bits == 0) {
+      return {};
+    }
+    if (is_unsigned) {
+      return result(op == "/" ? left.bits / right.bits
+                              : left.bits % right.bits);
+    }
+    if (signed_value(right) == -1) {
+      // INTMAX_MIN / -1 overflows
+      return result(op == "/" ? 0 - left.bits : 0);
+    }
+    return result(static_cast<std::uintmax_t>(
+        op == "/" ? signed_value(left) / signed_value(right)
+                  : signed_value(left) % signed_value(right)));
+  }
+
+  // Literals too large for intmax_t are unsigned, as if they had a u suffix
+  static auto number(std::string value) -> std::optional<Value> {
+    std::erase(value, '\'');
+    auto is_unsigned = false;
+    while (!value.empty() && std::string_view{"uUlLzZ"}.find(value.back()) !=
+                                 std::string_view::npos) {
+      is_unsigned = is_unsigned || value.back() == 'u' || value.back() == 'U';
+      value.pop_back();
+    }
+    auto base = 10;
+    std::size_t skip = 0;
+    if (value.starts_with("0x") || value.starts_with("0X")) {
+      base = 16;
+      skip = 2;
+    } else if (value.starts_with("0b") || value.starts_with("0B")) {
+      base = 2;
+      skip = 2;
+    } else if (value.size() > 1 && value.front() == '0') {
+      base = 8;
+      skip = 1;
+    }
+    std::uintmax_t result{};
+    auto const *end = value.data() + value.size();
+    auto [ptr, ec] = std::from_chars(value.data() + skip, end, result, base);
+    if (ec != std::errc{} || ptr != end) {
+      return {};
+    }
+    return Value{result,
+                 is_unsigned ||
+                     result > static_cast<std::uintmax_t>(
+                                  std::numeric_limits<std::intmax_t>::max())};
+  }
+
+  // Plain characters are signed chars and wide ones 32 bit signed, as on the
+  // usual targets, and the rest unsigned. A plain literal of several
+  // characters packs them into an int, as GCC and Clang do.
+  static auto character(std::string_view literal) -> std::optional<Value> {
+    auto quote = literal.find('\'');
+    if (literal.size() < quote + 3 || literal.back() != '\'') {
+      return {};
+    }
+    auto prefix = literal.substr(0, quote);
+    auto body = literal.substr(quote + 1, literal.size() - quote - 2);
+    auto wide = !prefix.empty() && prefix != "u8";
+    std::vector<std::uint32_t> units;
+    for (auto it = body.begin(); it != body.end();) {
+      if (*it != '\\') {
+        if (!wide) {
+          units.push_back(static_cast<unsigned char>(*it++));
+        } else if (auto code_point = decode_utf8(it, body.end())) {
+          units.push_back(*code_point);
+        } else {
+          return {};
+        }
+        continue;
+      }
+      if (auto code_point = read_universal_character_name(it, body.end())) {
+        units.push_back(*code_point);
+        continue;
+      }
+      if (++it == body.end()) {
+        return {};
+      }
+      constexpr std::string_view simple = "'\"?\\abfnrtv";
+      constexpr std::string_view meaning = "'\"?\\\a\b\f\n\r\t\v";
+      auto digit_value = [](char c, int base) -> std::optional<std::uint32_t> {
+        auto value = c >= '0' && c <= '9'   ? c - '0'
+                     : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                     : c >= 'A' && c <= 'F' ? c - 'A' + 10
+                                            : base;
+        return value < base ? std::optional<std::uint32_t>(value)
+                            : std::nullopt;
+      };
+      if (auto found = simple.find(*it); found != std::string_view::npos) {
+        units.push_back(static_cast<unsigned char>(meaning[found]));
+        it++;
+      } else if (*it == 'x' || digit_value(*it, 8).has_value()) {
+        auto base = *it == 'x' ? 16 : 8;
+        auto limit = base == 8 ? 3 : std::numeric_limits<int>::max();
+        if (base == 16) {
+          it++;
+        }
+        std::uint64_t value{};
+        auto digits = 0;
+        for (; it != body.end() && digits < limit; it++, digits++) {
+          auto digit = digit_value(*it, base);
+          if (!digit.has_value() || value > UINT32_MAX) {
+            break;
+          }
+          value = value * base + *digit;
+        }
+        if (digits == 0 || value > UINT32_MAX) {
+          return {};
+        }
+        units.push_back(static_cast<std::uint32_t>(value));
+      } else {
+        return {};
+      }
+    }
+    if (units.empty()) {
+      return {};
+    }
+    if (prefix.empty()) {
+      std::uint32_t packed{};
+      for (auto unit : units) {
+        if (unit > UINT8_MAX) {
+          return {};
+        }
+        packed = packed << 8 | unit;
+      }
+      auto value = units.size() == 1
+                       ? static_cast<std::intmax_t>(
+                             static_cast<signed char>(packed))
+                       : static_cast<std::intmax_t>(
+                             static_cast<std::int32_t>(packed));
+      return Value{static_cast<std::uintmax_t>(value)};
+    }
+    if (units.size() != 1) {
+      return {};
+    }
+    auto unit = units.front();
+    if (prefix == "L") {
+      return Value{static_cast<std::uintmax_t>(
+          static_cast<std::intmax_t>(static_cast<std::int32_t>(unit)))};
+    }
+    if ((prefix == "u8" && unit > UINT8_MAX) ||
+        (prefix == "u" && unit > UINT16_MAX)) {
+      return {};
+    }
+    return Value{unit, true};
+  }
+
+  // The operand that does not decide the result of &&, || or ?: is not
+  // evaluated, so dividing by zero in it is fine (C++ [expr.log.and])
+  auto operand(bool evaluated, auto parse) -> std::optional<Value> {
+    unevaluated += evaluated ? 0 : 1;
+    auto value = parse();
+    unevaluated -= evaluated ? 0 : 1;
+    return value;
+  }
+
+  auto conditional() -> std::optional<Value> {
+    auto condition = binary(1);
+    if (!condition.has_value() || !accept("?")) {
+      return condition;
+    }
+    auto taken = condition->bits != 0;
+    auto if_true = operand(taken, [&]() { return conditional(); });
+    if (!accept(":")) {
+      return {};
+    }
+    auto if_false = operand(!taken, [&]() { return conditional(); });
+    if (!if_true.has_value() || !if_false.has_value()) {
+      return {};
+    }
+    auto value = taken ? *if_true : *if_false;
+    value.is_unsigned = if_true->is_unsigned || if_false->is_unsigned;
+    return value;
+  }
+
+  auto binary(int minimum) -> std::optional<Value> {
+    auto left = unary();
+    while (left.has_value() && index < tokens.size()) {
+      auto *op = std::get_if<OperatorOrPunctuator>(&tokens[index]);
+      if (op == nullptr || precedence(op->value) < minimum ||
+          precedence(op->value) == 0) {
+        break;
+      }
+      index++;
+      auto decided = (op->value == "&&" && left->bits == 0) ||
+                     (op->value == "||" && left->bits != 0);
+      auto right = operand(!decided, [&]() {
+        return binary(precedence(op->value) + 1);
+      });
+      if (!right.has_value()) {
+        return {};
+      }
+      auto value = apply(op->value, *left, *right);
+      if (!value.has_value() && unevaluated > 0) {
+        value = Value{0, left->is_unsigned || right->is_unsigned};
+      }
+      left = value;
+    }
+    return left;
+  }
+
+  auto unary() -> std::optional<Value> {
+    if (index >= tokens.size()) {
+      return {};
+    }
+    if (accept("!")) {
+      auto value = unary();
+      return value.has_value() ? std::optional<Value>{truth(value->bits == 0)}
+                               : value;
+    }
+    if (accept("~")) {
+      auto value = unary();
+      return value.has_value()
+                 ? std::optional<Value>{Value{~value->bits,
+                                              value->is_unsigned}}
+                 : value;
+    }
+    if (accept("-")) {
+      auto value = unary();
+      return value.has_value()
+                 ? std::optional<Value>{Value{0 - value->bits,
+                                              value->is_unsigned}}
+                 : value;
+    }
+    if (accept("+")) {
+      return unary();
+    }
+    if (accept("(")) {
+      auto value = conditional();
+      if (!accept(")")) {
+        return {};
+      }
+      return value;
+    }
+    auto const &token = tokens[index++];
+    if (auto *ppnumber = std::get_if<PPNumber>(&token)) {
+      return number(ppnumber->value);
+    }
+    if (auto *raw = std::get_if<RawPreprocessorToken>(&token)) {
+      return character(raw->raw_token);
+    }
+    if (auto name = identifier_name(token)) {
+      // Identifiers and keywords left over after macro expansion evaluate to
+      // 0, except for true
+      return truth(*name == "true");
+    }
+    return {};
+  }
+
+  std::vector<PreProcessorToken> tokens;
+  std::size_t index{};
+  // How deep parsing is in operands that are not evaluated
+  int unevaluated{};
+};
+} // namespace
+
+auto Preprocessor::evaluate(std::vector<PreProcessorToken> const &line,
+                            std::size_t begin) -> bool {
+  std::vector<ExpandedToken> tokens;
+  for (auto i = begin; i < line.size(); i++) {
+    if (identifier_name(line[i]) != "defined") {
+      tokens.push_back({line[i]});
+      continue;
+    }
+    auto next = i + 1;
+    auto parenthesized = next < line.size() && is_punctuator(line[next], "(");
+    if (parenthesized) {
+      next++;
+    }
+    auto name = next < line.size() ? identifier_name(line[next])
+                                   : std::optional<std::string_view>{};
+    if (!name.has_value() ||
+        (parenthesized &&
+         (next + 1 >= line.size() || !is_punctuator(line[next + 1], ")")))) {
+      report(token_position(line[i]),
+             "Invalid use of defined in conditional directive");
+      return false;
+    }
+    tokens.push_back({PPNumber{is_defined(*name) ? "1" : "0",
+                               token_position(line[i])}});
+    i = parenthesized ? next + 1 : next;
+  }
+
+  std::vector<PreProcessorToken> expanded;
+  for (auto &token : expand_all(tokens)) {
+    expanded.push_back(std::move(token.token));
+  }
+  auto value = ConditionParser{expanded}.parse();
+  if (!value.has_value()) {
+    report(token_position(line[begin - 1]),
+           "Invalid expression in conditional directive");
+    return false;
+  }
+  return *value != 0;
+}
+
+auto Preprocessor::skip_inactive_branch() -> void {
+  auto begin = lexer().position();
+  auto record = [&](Position end) {
+    if (files.size() == 1) {
+      inactive.push_back({begin, end});
+    }
+  };
+  std::size_t depth = 0;
+  while (lexer().skip_to_directive()) {
+    auto end = lexer().position();
+    std::vector<PreProcessorToken> line;
+    read_line(line);
+    auto name = line.size() > 1 ? identifier_name(line[1])
+                                : std::optional<std::string_view>{};
+    if (!name.has_value()) {
+      continue;
+    }
+    if (*name == "if" || *name == "ifdef" || *name == "ifndef") {
+      depth++;
+      continue;
+    }
+    if (depth > 0) {
+      if (*name == "endif") {
+        depth--;
+      }
+      continue;
+    }
+    if (*name == "endif") {
+      conditionals.pop_back();
+      on_conditional_closed();
+      record(end);
+      return;
+    }
+    if (*name != "else" && *name != "elif") {
+      continue;
+    }
+    on_directive(*name, line);
+    auto &conditional = conditionals.back();
+    if (conditional.taken) {
+      continue;
+    }
+    if (*name == "else" || evaluate(line, 2)) {
+      conditional.taken = true;
+      record(end);
+      return;
+    }
+  }
+  // The end of the file is reported once the caller runs out of tokens
+  record(lexer().position());
+  skipped_to_end = files.size() == 1;
+}
@@ -0,0 +1,227 @@
+#pragma once
+
+#include <interner.h>
+#include <lexer.h>
+
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+struct ReplacementToken {
+  PreProcessorToken token;
+  std::optional<std::size_t> parameter;
+};
+
+struct Macro {
+  bool function_like{false};
+  bool variadic{false};
+  std::vector<Symbol> parameters;
+  std::vector<ReplacementToken> replacement;
+};
+
+struct Diagnostic {
+  std::filesystem::path file;
+  Position position;
+  std::string message;
+};
+
+struct SourceRange {
+  Position begin;
+  Position end;
+};
+
+class Preprocessor {
+public:
+  class Preamble;
+
+  Preprocessor(std::filesystem::path const &path,
+               std::vector<std::filesystem::path> include_directories = {});
+  // Preprocesses `source` as the content of `path`, e.g. an unsaved editor
+  // buffer. If `preamble` was taken from an earlier version of the buffer and
+  // is still valid, the state after the preamble is restored from it instead
+  // of processing the #include block again.
+  Preprocessor(std::filesystem::path const &path, std::string source,
+               std::vector<std::filesystem::path> include_directories = {},
+               std::shared_ptr<Preamble const> preamble = {});
+
+  auto get_next_token() -> std::optional<PreProcessorToken>;
+
+  auto is_defined(std::string_view name) const -> bool;
+
+  // Lines of the main file skipped by conditional compilation, up to but not
+  // including the directive that ended them
+  auto inactive_regions() const -> std::vector<SourceRange> const &;
+
+  // Problems found so far, in the order they were found. Recovery carries on
+  // as if the offending directive or invocation was not there.
+  auto diagnostics() const -> std::vector<Diagnostic> const &;
+
+  // State after the directives at the top of a buffer, available once the
+  // first token after them has been read. Empty when preprocessing a file
+  // from disk.
+  auto preamble() const -> std::shared_ptr<Preamble const>;
+
+private:
+  struct ExpandedToken {
+    ExpandedToken(PreProcessorToken token, std::vector<Symbol> hide_set = {},
+                  bool expandable = true)
+        : token(std::move(token)), hide_set(std::move(hide_set)),
+          expandable(expandable) {}
+
+    PreProcessorToken token;
+    // Macros that may not be expanded again from this token (C++ [cpp.rescan])
+    std::vector<Symbol> hide_set;
+    bool expandable{true};
+  };
+  using TokenQueue = std::deque<ExpandedToken>;
+  using Arguments = std::vector<std::vector<ExpandedToken>>;
+
+  struct Conditional {
+    // Whether one of the branches so far was active
+    bool taken;
+  };
+
+  // Tracks whether a file is wrapped in `#ifndef X ... #endif` with nothing
+  // outside of it
+  enum class GuardState { Start, InGuard, AfterGuard, NotGuarded };
+
+  struct File {
+    Lexer lexer;
+    std::size_t conditional_base;
+    GuardState guard_state{GuardState::Start};
+    std::optional<Symbol> guard;
+    std::string key;
+  };
+
+  // What we learned about a header the first time it was lexed
+  struct IncludeInfo {
+    std::optional<Symbol> guard;
+    bool pragma_once{false};
+  };
+
+  auto next_raw(TokenQueue &input, bool from_lexer)
+      -> std::optional<ExpandedToken>;
+  auto read_lexer_token() -> std::optional<ExpandedToken>;
+  auto expand_next(TokenQueue &input, bool from_lexer)
+      -> std::optional<ExpandedToken>;
+  auto expand_all(std::vector<ExpandedToken> const &tokens)
+      -> std::vector<ExpandedToken>;
+  auto macro_to_expand(ExpandedToken const &token) const
+      -> std::optional<Symbol>;
+  auto collect_arguments(Macro const &macro, TokenQueue &input,
+                         bool from_lexer) -> std::optional<Arguments>;
+  auto expand_object_like(Symbol symbol, ExpandedToken const &name)
+      -> std::vector<ExpandedToken>;
+  auto expand_function_like(Symbol symbol, ExpandedToken const &name,
+                            Arguments const &arguments)
+      -> std::vector<ExpandedToken>;
+  auto substitute(Macro const &macro, Arguments const &arguments)
+      -> std::vector<ExpandedToken>;
+
+  auto report(Position position, std::string message) -> void;
+  auto lexer() -> Lexer &;
+  auto finish_file() -> void;
+  auto include(std::vector<PreProcessorToken> const &line) -> void;
+  auto resolve_include(std::string const &name, bool quoted)
+      -> std::optional<std::string>;
+  auto guard_macro(std::vector<PreProcessorToken> const &line) const
+      -> std::optional<std::string_view>;
+  auto on_directive(std::string_view name,
+                    std::vector<PreProcessorToken> const &line) -> void;
+  auto on_conditional_closed() -> void;
+  auto capture_preamble() -> void;
+  auto restore_preamble(Preamble const &preamble) -> void;
+
+  auto read_line(std::vector<PreProcessorToken> &line)
+      -> std::optional<PreProcessorToken>;
+  auto handle_directive(std::vector<PreProcessorToken> const &line) -> bool;
+  auto evaluate(std::vector<PreProcessorToken> const &line, std::size_t begin)
+      -> bool;
+  auto skip_inactive_branch() -> void;
+  auto define(std::vector<PreProcessorToken> const &line) -> void;
+  auto undef(std::vector<PreProcessorToken> const &line) -> void;
+  auto invalidate_expansions() -> void;
+
+  std::vector<File> files;
+  std::vector<std::filesystem::path> include_directories;
+  Interner symbols;
+  // Indexed by Symbol so a lookup is a single array access after interning
+  std::vector<std::optional<Macro>> macros;
+  Symbol va_args;
+
+  // Expansions only depend on the macro table, so they stay valid until the
+  // next #define or #undef
+  std::unordered_map<Symbol, std::vector<ExpandedToken>> object_like_cache;
+  std::unordered_map<std::string, std::vector<ExpandedToken>>
+      function_like_cache;
+
+  TokenQueue pending;
+  bool at_line_start{true};
+
+  std::vector<Conditional> conditionals;
+  std::vector<SourceRange> inactive;
+  std::vector<Diagnostic> problems;
+  // Whether the main file ended while skipping an inactive branch
+  bool skipped_to_end{false};
+
+  // Keyed by the canonical path of the header
+  std::unordered_map<std::string, IncludeInfo> include_info;
+  // Keyed by the including directory and the spelling of the header name
+  std::unordered_map<std::string, std::optional<std::string>> resolved;
+
+  struct LineStart {
+    std::size_t offset;
+    Position position;
+  };
+  bool recording_preamble{false};
+  LineStart preamble_end{};
+  std::vector<PreProcessorToken> preamble_tokens;
+  std::vector<std::filesystem::path> preamble_dependencies;
+  std::vector<std::filesystem::path> preamble_misses;
+  std::shared_ptr<Preamble const> preamble_snapshot;
+};
+
+class Preprocessor::Preamble {
+public:
+  // Whether the snapshot still describes a buffer with this content and
+  // these include directories, i.e. the preamble text is unchanged, none of
+  // the included files changed and no header turned up where a lookup found
+  // nothing
+  auto is_valid_for(std::string_view source,
+                    std::vector<std::filesystem::path> const
+                        &include_directories) const -> bool;
+
+private:
+  friend Preprocessor;
+
+  // A file that was read, or a place an #include looked for a header and
+  // found none
+  struct Dependency {
+    std::filesystem::path path;
+    bool exists;
+    std::filesystem::file_time_type modified;
+    std::uintmax_t size;
+  };
+
+  std::string text;
+  std::vector<std::filesystem::path> include_directories;
+  Position end;
+  std::vector<PreProcessorToken> tokens;
+  std::vector<Dependency> dependencies;
+
+  Interner symbols;
+  std::vector<std::optional<Macro>> macros;
+  std::vector<Conditional> conditionals;
+  std::vector<SourceRange> inactive;
+  std::vector<Diagnostic> problems;
+  GuardState guard_state;
+  std::optional<Symbol> guard;
+  std::unordered_map<std::string, IncludeInfo> include_info;
+  std::unordered_map<std::string, std::optional<std::string>> resolved;
+};
@@ -0,0 +1,111 @@
+#include "scheduler.h"
+
+#include <algorithm>
+
+Scheduler::Scheduler(std::size_t threads)
+    : threads(std::max<std::size_t>(threads, 1)) {
+  for (std::size_t i = 0; i < this->threads; i++) {
+    workers.emplace_back([this](std::stop_token stop) { run(stop); });
+  }
+}
+
+Scheduler::~Scheduler() {
+  {
+    std::unique_lock lock(mutex);
+    for (auto &queue : queues) {
+      queue.clear();
+    }
+    for (auto &[key, source] : running) {
+      source.request_stop();
+    }
+  }
+  // Joining requests the workers stop, which wakes the idle ones
+  workers.clear();
+}
+
+auto Scheduler::submit(std::string key, Priority priority, Job job) -> void {
+  {
+    std::unique_lock lock(mutex);
+    for (auto &queue : queues) {
+      std::erase_if(queue, [&](Task const &task) { return task.key == key; });
+    }
+    auto found = running.find(key);
+    if (found != running.end()) {
+      found->second.request_stop();
+    }
+    queues[static_cast<std::size_t>(priority)].push_back(
+        {std::move(key), std::move(job)});
+  }
+  work_available.notify_all();
+}
+
+auto Scheduler::wait_idle() -> void {
+  std::unique_lock lock(mutex);
+  idle.wait(lock, [this]() { return is_idle(); });
+}
+
+auto Scheduler::background_threads() const -> std::size_t {
+  return threads > 1 ? threads - 1 : 1;
+}
+
+auto Scheduler::run(std::stop_token stop) -> void {
+  std::unique_lock lock(mutex);
+  while (true) {
+    Priority priority{};
+    std::deque<Task>::iterator found;
+    if (!work_available.wait(lock, stop,
+                             [&]() { return next_task(priority, found); })) {
+      return;
+    }
+    auto &queue = queues[static_cast<std::size_t>(priority)];
+    auto task = std::move(*found);
+    queue.erase(found);
+    auto background = priority != Priority::OpenDocument;
+    if (background) {
+      background_running++;
+    }
+    std::stop_source source;
+    running.emplace(task.key, source);
+
+    lock.unlock();
+    task.job(source.get_token());
+    lock.lock();
+
+    running.erase(task.key);
+    if (background) {
+      background_running--;
+    }
+    // A task waiting on this key or on a background slot may start now
+    work_available.notify_all();
+    if (is_idle()) {
+      idle.notify_all();
+    }
+  }
+}
+
+auto Scheduler::next_task(Priority &priority,
+                          std::deque<Task>::iterator &task) -> bool {
+  for (std::size_t i = 0; i < queues.size(); i++) {
+    auto background = static_cast<Priority>(i) != Priority::OpenDocument;
+    if (background && threads > 1 && background_running + 1 >= threads) {
+      break;
+    }
+    auto &queue = queues[i];
+    auto found =
+        std::find_if(queue.begin(), queue.end(), [&](Task const &task) {
+          return !running.contains(task.key);
+        });
+    if (found != queue.end()) {
+      priority = static_cast<Priority>(i);
+      task = found;
+      return true;
+    }
+  }
+  return false;
+}
+
+auto Scheduler::is_idle() const -> bool {
+  return running.empty() &&
+         std::all_of(queues.begin(), queues.end(),
+                     [](auto const &queue) { return queue.empty(); });
+}
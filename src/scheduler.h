@@ -0,0 +1,62 @@
+#pragma once
+
+#include <array>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Lower values run first
+enum class Priority { OpenDocument, Include, Workspace };
+
+// Runs background work on a fixed number of threads. Work for the open
+// documents always goes first, and unless there is only one thread, one of
+// them is kept free of background work so an edit never waits for a batch
+// of workspace files to finish.
+class Scheduler {
+public:
+  using Job = std::function<void(std::stop_token)>;
+
+  explicit Scheduler(std::size_t threads = std::thread::hardware_concurrency());
+  Scheduler(Scheduler const &) = delete;
+  auto operator=(Scheduler const &) -> Scheduler & = delete;
+  // Drops queued jobs and asks running ones to stop
+  ~Scheduler();
+
+  // Jobs with the same key do the same work on newer input, so a queued job
+  // with that key is replaced and a running one is asked to stop. Jobs with
+  // the same key never run at the same time.
+  auto submit(std::string key, Priority priority, Job job) -> void;
+  // Blocks until nothing is queued or running
+  auto wait_idle() -> void;
+  // How many background jobs may run at once
+  auto background_threads() const -> std::size_t;
+
+private:
+  struct Task {
+    std::string key;
+    Job job;
+  };
+
+  auto run(std::stop_token stop) -> void;
+  // Finds the most urgent task that may start now
+  auto next_task(Priority &priority, std::deque<Task>::iterator &task) -> bool;
+  auto is_idle() const -> bool;
+
+  std::size_t threads;
+  std::mutex mutex;
+  std::condition_variable_any work_available;
+  std::condition_variable idle;
+  std::array<std::deque<Task>, 3> queues;
+  // Keyed by Task::key, to stop jobs that newer input made stale
+  std::unordered_map<std::string, std::stop_source> running;
+  std::size_t background_running{};
+  std::vector<std::jthread> workers;
+};
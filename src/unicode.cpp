@@ -0,0 +1,37 @@
+#include "unicode.h"
+
+#include <bit>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+auto find_invalid_utf8(std::string_view text) -> std::optional<std::size_t> {
+  auto const *data = text.data();
+  auto const *end = data + text.size();
+  auto const *it = data;
+  while (it != end) {
+#if defined(__SSE2__)
+    // Source code is mostly ASCII, which has the top bit of every byte clear,
+    // so whole blocks of it pass with a single test
+    while (end - it >= 16) {
+      auto block = _mm_loadu_si128(reinterpret_cast<__m128i const *>(it));
+      auto high = static_cast<unsigned>(_mm_movemask_epi8(block));
+      if (high != 0) {
+        it += std::countr_zero(high);
+        break;
+      }
+      it += 16;
+    }
+    if (it == end) {
+      break;
+    }
+#endif
+    if (is_ascii(*it)) {
+      it++;
+    } else if (!decode_utf8(it, end).has_value()) {
+      return static_cast<std::size_t>(it - data);
+    }
+  }
+  return {};
+}
@@ -0,0 +1,234 @@
+#include "watcher.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+namespace {
+constexpr std::uint32_t watched_events = IN_CLOSE_WRITE | IN_CREATE |
+                                         IN_DELETE | IN_MOVED_FROM |
+                                         IN_MOVED_TO | IN_ONLYDIR;
+
+auto is_hidden(std::filesystem::path const &path) -> bool {
+  return path.filename().string().starts_with('.');
+}
+
+// Calls `visit` with every regular file below `directory`
+template <typename Visit>
+auto for_each_file(std::filesystem::path const &directory, Visit visit)
+    -> void {
+  std::error_code error;
+  std::filesystem::recursive_directory_iterator it(
+      directory, std::filesystem::directory_options::skip_permission_denied,
+      error);
+  for (; !error && it != std::filesystem::recursive_directory_iterator();
+       it.increment(error)) {
+    if (it->is_directory(error) && is_hidden(it->path())) {
+      it.disable_recursion_pending();
+    } else if (it->is_regular_file(error)) {
+      visit(it->path());
+    }
+  }
+}
+} // namespace
+
+auto FileChanges::empty() const -> bool {
+  return changed.empty() && removed.empty();
+}
+
+FileWatcher::FileWatcher(std::filesystem::path const &root)
+    : root(root), fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) {
+  if (fd < 0) {
+    std::cerr << "Could not start watching " << root << ": "
+              << std::strerror(errno) << '\n';
+    return;
+  }
+  watch(root);
+}
+
+FileWatcher::~FileWatcher() {
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+auto FileWatcher::valid() const -> bool { return fd >= 0; }
+
+auto FileWatcher::wait_for_changes(std::chrono::milliseconds quiet_period,
+                                   std::stop_token stop) -> FileChanges {
+  using namespace std::chrono_literals;
+  FileChanges result;
+  if (!valid()) {
+    return result;
+  }
+  std::unordered_map<std::string, bool> changes;
+  auto overflowed = false;
+  // Wake up regularly to notice `stop` and to rescan what is not watched
+  while (!stop.stop_requested() && !read_events(100ms, changes, overflowed) &&
+         !rescan(changes)) {
+  }
+  while (!stop.stop_requested() &&
+         (read_events(quiet_period, changes, overflowed) || rescan(changes))) {
+  }
+  if (overflowed) {
+    for_each_file(root, [&](std::filesystem::path const &path) {
+      changes[path.string()] = false;
+    });
+  }
+  for (auto &[path, removed] : changes) {
+    (removed ? result.removed : result.changed).emplace_back(path);
+  }
+  std::sort(result.changed.begin(), result.changed.end());
+  std::sort(result.removed.begin(), result.removed.end());
+  return result;
+}
+
+auto FileWatcher::watch(std::filesystem::path const &directory) -> void {
+  auto add = [this](std::filesystem::path const &path) {
+    auto descriptor = inotify_add_watch(fd, path.c_str(), watched_events);
+    if (descriptor < 0) {
+      // Usually the limit on watches, which every directory after this one
+      // runs into as well, so that is only reported once
+      if (unwatched.empty()) {
+        std::cerr << "Could not watch " << path << ": "
+                  << std::strerror(errno)
+                  << ", rescanning the directories that cannot be watched\n";
+      }
+      unwatched.push_back(path);
+      snapshot(path);
+      return;
+    }
+    directories[descriptor] = path;
+  };
+  add(directory);
+  std::error_code error;
+  std::filesystem::recursive_directory_iterator it(
+      directory, std::filesystem::directory_options::skip_permission_denied,
+      error);
+  for (; !error && it != std::filesystem::recursive_directory_iterator();
+       it.increment(error)) {
+    if (!it->is_directory(error)) {
+      continue;
+    }
+    if (is_hidden(it->path())) {
+      it.disable_recursion_pending();
+      continue;
+    }
+    add(it->path());
+  }
+}
+
+auto FileWatcher::snapshot(std::filesystem::path const &directory) -> void {
+  std::error_code error;
+  std::filesystem::directory_iterator it(directory, error);
+  for (; !error && it != std::filesystem::directory_iterator();
+       it.increment(error)) {
+    if (it->is_directory(error)) {
+      if (!is_hidden(it->path())) {
+        unwatched_entries[it->path().string()] = std::nullopt;
+      }
+    } else if (it->is_regular_file(error)) {
+      unwatched_entries[it->path().string()] = it->last_write_time(error);
+    }
+  }
+}
+
+auto FileWatcher::rescan(std::unordered_map<std::string, bool> &changes)
+    -> bool {
+  if (unwatched.empty()) {
+    return false;
+  }
+  std::erase_if(unwatched, [](std::filesystem::path const &directory) {
+    std::error_code error;
+    return !std::filesystem::is_directory(directory, error);
+  });
+  auto before = std::move(unwatched_entries);
+  unwatched_entries.clear();
+  for (auto const &directory : unwatched) {
+    snapshot(directory);
+  }
+  auto changed = false;
+  std::vector<std::filesystem::path> created;
+  for (auto const &[path, modified] : unwatched_entries) {
+    auto found = before.find(path);
+    if (found != before.end() && found->second == modified) {
+      continue;
+    }
+    if (!modified.has_value()) {
+      created.emplace_back(path);
+    } else {
+      changes[path] = false;
+      changed = true;
+    }
+  }
+  for (auto const &[path, modified] : before) {
+    if (modified.has_value() && !unwatched_entries.contains(path)) {
+      changes[path] = true;
+      changed = true;
+    }
+  }
+  // As for a directory created where inotify sees it
+  for (auto const &directory : created) {
+    watch(directory);
+    for_each_file(directory, [&](std::filesystem::path const &file) {
+      changes[file.string()] = false;
+    });
+    changed = true;
+  }
+  return changed;
+}
+
+auto FileWatcher::read_events(std::chrono::milliseconds timeout,
+                              std::unordered_map<std::string, bool> &changes,
+                              bool &overflowed) -> bool {
+  pollfd request{fd, POLLIN, 0};
+  if (poll(&request, 1, static_cast<int>(timeout.count())) <= 0) {
+    return false;
+  }
+  alignas(inotify_event) char buffer[64 * 1024];
+  while (true) {
+    auto size = read(fd, buffer, sizeof(buffer));
+    if (size <= 0) {
+      break;
+    }
+    for (auto *data = buffer; data < buffer + size;) {
+      auto const *event = reinterpret_cast<inotify_event const *>(data);
+      data += sizeof(inotify_event) + event->len;
+      if ((event->mask & IN_Q_OVERFLOW) != 0) {
+        overflowed = true;
+        continue;
+      }
+      auto directory = directories.find(event->wd);
+      if (directory == directories.end()) {
+        continue;
+      }
+      if ((event->mask & IN_IGNORED) != 0) {
+        directories.erase(directory);
+        continue;
+      }
+      if (event->len == 0) {
+        continue;
+      }
+      auto path = directory->second / event->name;
+      if ((event->mask & IN_ISDIR) == 0) {
+        changes[path.string()] =
+            (event->mask & (IN_DELETE | IN_MOVED_FROM)) != 0;
+      } else if ((event->mask & (IN_CREATE | IN_MOVED_TO)) != 0 &&
+                 !is_hidden(path)) {
+        // Files can land in a new directory before it is watched, and a
+        // moved in tree is new in its entirety
+        watch(path);
+        for_each_file(path, [&](std::filesystem::path const &file) {
+          changes[file.string()] = false;
+        });
+      }
+    }
+  }
+  return true;
+}
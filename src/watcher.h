@@ -0,0 +1,62 @@
+#pragma once
+
+#include <chrono>
+#include <filesystem>
+#include <optional>
+#include <stop_token>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct FileChanges {
+  std::vector<std::filesystem::path> changed;
+  std::vector<std::filesystem::path> removed;
+
+  auto empty() const -> bool;
+};
+
+// Watches a directory tree with inotify, skipping hidden directories such as
+// .git. Events are collected until the tree has been quiet for a while, so a
+// branch switch that rewrites thousands of files arrives as one batch with
+// every path listed once. Directories inotify refuses to watch, e.g. past
+// fs.inotify.max_user_watches, are rescanned for changes instead.
+class FileWatcher {
+public:
+  explicit FileWatcher(std::filesystem::path const &root);
+  FileWatcher(FileWatcher const &) = delete;
+  auto operator=(FileWatcher const &) -> FileWatcher & = delete;
+  ~FileWatcher();
+
+  // False if inotify was unavailable, in which case no changes ever arrive
+  auto valid() const -> bool;
+  // Blocks until something changed and then nothing else changed for
+  // `quiet_period`. Returns what was collected so far once `stop` is
+  // requested. If the kernel dropped events, every file counts as changed.
+  auto wait_for_changes(std::chrono::milliseconds quiet_period,
+                        std::stop_token stop) -> FileChanges;
+
+private:
+  auto watch(std::filesystem::path const &directory) -> void;
+  // Adds what a directory that could not be watched holds to
+  // `unwatched_entries`
+  auto snapshot(std::filesystem::path const &directory) -> void;
+  // Adds what changed in the directories that could not be watched since the
+  // last scan to `changes`. Returns false if nothing did.
+  auto rescan(std::unordered_map<std::string, bool> &changes) -> bool;
+  // Adds the pending events to `changes`, which maps each path to whether it
+  // was removed. Returns false if there were none within `timeout`.
+  auto read_events(std::chrono::milliseconds timeout,
+                   std::unordered_map<std::string, bool> &changes,
+                   bool &overflowed) -> bool;
+
+  std::filesystem::path root;
+  int fd{-1};
+  // Indexed by inotify watch descriptor
+  std::unordered_map<int, std::filesystem::path> directories;
+  std::vector<std::filesystem::path> unwatched;
+  // The files and subdirectories directly in `unwatched`, with the time each
+  // file was last modified
+  std::unordered_map<std::string,
+                     std::optional<std::filesystem::file_time_type>>
+      unwatched_entries;
+};
@@ -0,0 +1,101 @@
+#include <completion.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// Measures completion latency per keystroke against a generated workspace of
+// a million identifiers. Only builds with optimizations enabled are held to
+// the 5 ms p99 target.
+constexpr std::size_t identifier_count = 1'000'000;
+constexpr std::size_t sessions = 200;
+constexpr std::size_t limit = 100;
+constexpr double target_ms = 5.0;
+
+constexpr std::array<std::string_view, 48> words{
+    "get",    "set",     "size",  "token",  "value",   "index",  "buffer",
+    "string", "parse",   "read",  "write",  "file",    "path",   "name",
+    "count",  "begin",   "end",   "next",   "prev",    "node",   "tree",
+    "list",   "map",     "key",   "type",   "data",    "item",   "find",
+    "insert", "remove",  "clear", "empty",  "lexer",   "macro",  "symbol",
+    "scope",  "context", "state", "result", "error",   "offset", "length",
+    "line",   "column",  "range", "source", "include", "config"};
+
+auto generate(std::mt19937 &random) -> std::string {
+  std::uniform_int_distribution<std::size_t> word(0, words.size() - 1);
+  std::uniform_int_distribution<int> parts(1, 4);
+  std::uniform_int_distribution<int> style(0, 2);
+  std::uniform_int_distribution<int> digits(0, 999);
+  auto count = parts(random);
+  auto chosen_style = style(random);
+  std::string identifier;
+  for (auto i = 0; i < count; i++) {
+    std::string part{words[word(random)]};
+    // snake_case, camelCase and PascalCase
+    if (chosen_style == 0 && i > 0) {
+      identifier += '_';
+    } else if ((chosen_style == 1 && i > 0) || chosen_style == 2) {
+      part.front() = static_cast<char>(part.front() - 'a' + 'A');
+    }
+    identifier += part;
+  }
+  if (digits(random) % 3 == 0) {
+    identifier += std::to_string(digits(random));
+  }
+  return identifier;
+}
+
+// What someone types: the start of a word, or the initials of a few
+auto query(std::mt19937 &random) -> std::string {
+  std::uniform_int_distribution<std::size_t> word(0, words.size() - 1);
+  std::uniform_int_distribution<int> kind(0, 2);
+  if (kind(random) != 0) {
+    return std::string{words[word(random)]};
+  }
+  std::string initials;
+  for (auto i = 0; i < 3; i++) {
+    initials += words[word(random)].front();
+  }
+  return initials;
+}
+
+int main() {
+  std::mt19937 random{42};
+  CompletionEngine engine;
+  while (engine.size() < identifier_count) {
+    engine.add(generate(random));
+  }
+
+  std::vector<double> latencies;
+  for (std::size_t session = 0; session < sessions; session++) {
+    auto typed = query(random);
+    for (std::size_t length = 1; length <= typed.size(); length++) {
+      auto begin = std::chrono::steady_clock::now();
+      engine.complete(std::string_view{typed}.substr(0, length), limit);
+      auto end = std::chrono::steady_clock::now();
+      latencies.push_back(
+          std::chrono::duration<double, std::milli>(end - begin).count());
+    }
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&](double p) {
+    return latencies[static_cast<std::size_t>(p * (latencies.size() - 1))];
+  };
+  std::cout << "completion over " << engine.size() << " identifiers, "
+            << latencies.size() << " keystrokes: p50 " << percentile(0.5)
+            << " ms, p99 " << percentile(0.99) << " ms, max "
+            << latencies.back() << " ms\n";
+#if defined(NDEBUG)
+  if (percentile(0.99) > target_ms) {
+    std::cout << "p99 is over the " << target_ms << " ms target\n";
+    return EXIT_FAILURE;
+  }
+#endif
+  return EXIT_SUCCESS;
+}
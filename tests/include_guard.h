@@ -0,0 +1,4 @@
+#ifndef INCLUDE_GUARD_H
+#define INCLUDE_GUARD_H
+guarded
+#endif
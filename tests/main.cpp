@@ -1,8 +1,15 @@
 #include <args.h>
+#include <atomic>
+#include <chrono>
+#include <completion.h>
 #include <filesystem>
 #include <fstream>
+#include <index.h>
+#include <indexer.h>
 #include <iostream>
+#include <iterator>
 #include <lexer.h>
+#include <preprocessor.h>
 #include <sstream>
 #include <vector>
 
@@ -20,8 +27,9 @@ template <typename T, typename U> auto compare(T &in, U &out) -> bool {
   return true;
 }
 
+template <typename TokenSource = Lexer>
 auto run_test(std::string_view test) -> bool {
-  Lexer lex(test);
+  TokenSource lex(test);
   std::string outfile = std::string{test} + "_out";
   if (!std::filesystem::exists(outfile)) {
     std::cerr << "Test: \"" << test << "\" No outfile available\n";
@@ -37,8 +45,8 @@ auto run_test(std::string_view test) -> bool {
   return compare(in, out);
 }
 
-auto create_out(std::string_view test) {
-  Lexer lex(test);
+template <typename TokenSource = Lexer> auto create_out(std::string_view test) {
+  TokenSource lex(test);
   std::string outfile = std::string{test} + "_out";
   if (std::filesystem::exists(outfile)) {
     std::filesystem::remove(outfile);
@@ -53,22 +61,486 @@ auto create_out(std::string_view test) {
   out.close();
 }
 
-constexpr std::array<std::string_view, 7> tests{
+template <typename TokenSource> auto token_dump(TokenSource &lex) {
+  std::stringstream dump{};
+  auto token = lex.get_next_token();
+  while (token.has_value()) {
+    dump << *token << '\n';
+    token = lex.get_next_token();
+  }
+  return dump.str();
+}
+
+// Appends to the buffer and checks that reusing the preamble snapshot of the
+// original gives the same tokens and diagnostics as preprocessing the edit
+// from scratch. There is no snapshot to reuse when the original ends while
+// lines are being skipped.
+auto run_preamble_test(std::string_view test, std::string const &source,
+                       std::string const &appended) -> bool {
+  Preprocessor original(test, source);
+  token_dump(original);
+  auto preamble = original.preamble();
+
+  auto edited = source + appended;
+  Preprocessor fresh(test, edited);
+  Preprocessor reused(test, edited, {}, preamble);
+  if (preamble != nullptr && reused.preamble() != preamble) {
+    std::cerr << "Test: \"" << test << "\" Preamble was not reused\n";
+    return false;
+  }
+  if (token_dump(fresh) != token_dump(reused)) {
+    return false;
+  }
+  auto same_diagnostic = [](Diagnostic const &a, Diagnostic const &b) {
+    return a.position == b.position && a.message == b.message;
+  };
+  return std::ranges::equal(fresh.diagnostics(), reused.diagnostics(),
+                            same_diagnostic);
+}
+
+auto run_preamble_test(std::string_view test) -> bool {
+  std::ifstream file{std::string{test}};
+  std::string source{std::istreambuf_iterator<char>(file),
+                     std::istreambuf_iterator<char>()};
+  Preprocessor original(test, source);
+  token_dump(original);
+  if (original.preamble() == nullptr) {
+    std::cerr << "Test: \"" << test << "\" No preamble captured\n";
+    return false;
+  }
+  return run_preamble_test(test, source, "edited\n");
+}
+
+// A header that was missing when the snapshot was taken, or other include
+// directories, make the preamble mean something else
+auto run_preamble_include_test() -> bool {
+  auto directory = std::filesystem::temp_directory_path() / "cpplsp_preamble";
+  std::filesystem::remove_all(directory);
+  std::filesystem::create_directories(directory);
+  auto main = directory / "main.cpp";
+  std::string source = "#include \"config.h\"\nint value = VALUE;\n";
+  Preprocessor missing(main, source);
+  token_dump(missing);
+  auto preamble = missing.preamble();
+  if (preamble == nullptr || missing.diagnostics().size() != 1) {
+    return false;
+  }
+  std::ofstream{directory / "config.h"} << "#define VALUE 42\n";
+  Preprocessor found(main, source + "int edited;\n", {}, preamble);
+  auto dump = token_dump(found);
+  auto passed = found.preamble() != preamble && found.diagnostics().empty() &&
+                dump.find("42") != std::string::npos;
+
+  Preprocessor original(main, source);
+  token_dump(original);
+  Preprocessor elsewhere(main, source, {directory}, original.preamble());
+  token_dump(elsewhere);
+  passed = passed && elsewhere.preamble() != original.preamble();
+  std::filesystem::remove_all(directory);
+  return passed;
+}
+
+// Buffers that end inside a conditional, as they do while one is being typed
+constexpr std::array<std::pair<std::string_view, std::string_view>, 3>
+    preamble_edits{{
+        {"#define A 1\n#if 0\nint a;\n", "int b;\n"},
+        {"#define A 1\n#ifdef A\n", "int b;\n#endif\n"},
+        {"#define A 1\n#if 1\n#else\n", "int b;\n#endif\n"},
+    }};
+
+// Problems are collected rather than printed, and an invocation that only
+// completes once its expansion is rescanned is not one of them
+auto run_diagnostics_test() -> bool {
+  Preprocessor rescanned("tests/diagnostics", "#define f(a) f(2 * (a))\n"
+                                              "#define g f\n"
+                                              "#define h g(~\n"
+                                              "h 5);\n");
+  std::string spelled;
+  while (auto token = rescanned.get_next_token()) {
+    if (!std::holds_alternative<NewLine>(*token)) {
+      spelled += token_spelling(*token) + ' ';
+    }
+  }
+  if (spelled != "f ( 2 * ( ~ 5 ) ) ; " ||
+      !rescanned.diagnostics().empty()) {
+    return false;
+  }
+
+  Preprocessor broken("tests/diagnostics", "#endif\n"
+                                           "#undef\n"
+                                           "#if 1 +\n"
+                                           "#endif\n");
+  token_dump(broken);
+  auto const &problems = broken.diagnostics();
+  return problems.size() == 3 &&
+         problems[0].message == "#endif without #if" &&
+         problems[0].position == Position{0, 1} &&
+         problems[1].message == "Missing macro name in #undef" &&
+         problems[1].position == Position{1, 1} &&
+         problems[2].message ==
+             "Invalid expression in conditional directive" &&
+         problems[2].position == Position{2, 1};
+}
+
+// Conditions follow C++ [cpp.cond]: unsigned arithmetic once an operand is
+// unsigned, character literals, and operands && || and ?: do not evaluate
+auto run_condition_test() -> bool {
+  auto evaluates_to = [](std::string const &condition) -> std::optional<bool> {
+    Preprocessor preprocessor("tests/condition", "#if " + condition +
+                                                     "\n#define HOLDS\n#endif\n");
+    token_dump(preprocessor);
+    if (!preprocessor.diagnostics().empty()) {
+      return {};
+    }
+    return preprocessor.is_defined("HOLDS");
+  };
+  constexpr std::array<std::pair<std::string_view, bool>, 20> conditions{{
+      {"-1 < 0", true},
+      {"-1 < 0u", false},
+      {"0x8000000000000000 > 0", true},
+      {"0xffffffffffffffffULL == -1", true},
+      {"18446744073709551615 / 2 == 0x7fffffffffffffff", true},
+      {"(0u - 1) >> 63 == 1", true},
+      {"-1 >> 63 == -1", true},
+      {"(1 ? -1 : 0u) > 0", true},
+      {"'A' == 65", true},
+      {"'a'=='a'&&'b'", true},
+      {"'\\n' == 10 && '\\x41' == 'A' && '\\101' == 'A'", true},
+      {"'\\377' < 0", true},
+      {"'\\'' == 39", true},
+      {"L'A' == 65 && u8'a' == 97", true},
+      {"u'A' - 66 > 0", true},
+      {"U'\\u00e9' == 0xe9", true},
+      {"0 && 1 / 0", false},
+      {"1 || 1 / 0", true},
+      {"1 ? 2 : 1 / 0", true},
+      {"0 ? 1 % 0 : 0 && 1 << 64", false},
+  }};
+  for (auto [condition, expected] : conditions) {
+    if (evaluates_to(std::string{condition}) != expected) {
+      std::cerr << "Condition \"" << condition << "\" failed\n";
+      return false;
+    }
+  }
+  return !evaluates_to("1 / 0").has_value() &&
+         !evaluates_to("1 << 64").has_value() &&
+         !evaluates_to("'ab").has_value();
+}
+
+// The lines conditional compilation skips, in nested conditionals, after
+// #elif and #else, and up to the end of a file that ends while skipping
+auto run_inactive_regions_test() -> bool {
+  auto skips = [](Preprocessor &preprocessor,
+                  std::vector<SourceRange> const &expected) {
+    token_dump(preprocessor);
+    return std::ranges::equal(
+        preprocessor.inactive_regions(), expected,
+        [](SourceRange const &a, SourceRange const &b) {
+          return a.begin == b.begin && a.end == b.end;
+        });
+  };
+  Preprocessor golden("tests/conditional_compilation");
+  if (!skips(golden, {{{3, 0}, {7, 0}},
+                      {{11, 0}, {12, 0}},
+                      {{15, 0}, {16, 0}},
+                      {{18, 0}, {22, 0}},
+                      {{24, 0}, {25, 0}},
+                      {{37, 0}, {41, 0}},
+                      {{44, 0}, {47, 0}}})) {
+    return false;
+  }
+  Preprocessor unterminated("tests/unterminated", "#if 1\n"
+                                                  "active\n"
+                                                  "#elif 1\n"
+                                                  "skipped\n"
+                                                  "#else\n"
+                                                  "also_skipped\n"
+                                                  "#endif\n"
+                                                  "#ifdef MISSING\n"
+                                                  "#if 1\n"
+                                                  "#endif\n"
+                                                  "last");
+  Preprocessor nested("tests/unterminated", "#if 0\n"
+                                            "skipped\n"
+                                            "#else\n"
+                                            "#if 0\n"
+                                            "last\n");
+  return skips(unterminated, {{{3, 0}, {6, 0}}, {{8, 0}, {10, 4}}}) &&
+         skips(nested, {{{1, 0}, {2, 0}}, {{4, 0}, {5, 0}}});
+}
+
+// Indexes the lexer tests and checks references survive a reindex of one file
+auto run_index_test() -> bool {
+  IdentifierIndex index;
+  index.index_files({"tests/hello_world", "tests/identifier"}, 2);
+  auto references = index.find_references("argc");
+  if (references.size() != 1 ||
+      index.file_path(references[0].file) != "tests/hello_world" ||
+      references[0].position != Position{2, 13}) {
+    return false;
+  }
+  if (index.find_prefix("hel", 10) != std::vector<std::string_view>{"hello"}) {
+    return false;
+  }
+  index.update_file("tests/hello_world", "int argc;\nargc = argc;\n");
+  // Results the filter turns down, like a file opened in the editor while
+  // the batch lexed, leave the buffer in place
+  index.index_files({"tests/hello_world", "tests/identifier"}, 2, {},
+                    [](auto const &path) { return path != "tests/hello_world"; });
+  // Files a stopped batch had no time for come back to be queued again
+  std::stop_source stopped;
+  stopped.request_stop();
+  if (index.index_files({"tests/hello_world"}, 1, stopped.get_token()) !=
+      std::vector<std::filesystem::path>{"tests/hello_world"}) {
+    return false;
+  }
+  references = index.find_references("argc");
+  return references.size() == 3 && references[2].position == Position{1, 7} &&
+         index.find_references("argv").empty();
+}
+
+auto run_completion_test() -> bool {
+  CompletionEngine engine;
+  Lexer lexer("tests/hello_world");
+  engine.add_identifiers(lexer);
+  for (auto identifier : {"get_value", "getValue", "gravity", "value_get"}) {
+    engine.add(identifier);
+  }
+  auto labels = [](std::vector<CompletionItem> const &items) {
+    std::vector<std::string_view> result;
+    for (auto const &item : items) {
+      result.push_back(item.label);
+    }
+    return result;
+  };
+  // Matches at word starts rank above the same letters mid word
+  if (labels(engine.complete("gv", 10)) !=
+      std::vector<std::string_view>{"getValue", "get_value", "gravity"}) {
+    return false;
+  }
+  // Narrowed from the previous query
+  if (labels(engine.complete("gval", 1)) !=
+      std::vector<std::string_view>{"getValue"}) {
+    return false;
+  }
+  // Stops after the first batch when told a newer query arrived
+  auto batches = 0;
+  engine.complete("a", 10, [&](auto const &) {
+    batches++;
+    return false;
+  }, 2);
+  return batches == 1 && engine.complete("argc", 10).size() == 1 &&
+         engine.complete("xyz", 10).empty();
+}
+
+auto run_scheduler_test() -> bool {
+  IdentifierIndex index;
+  Scheduler scheduler(2);
+  // Holds the only thread background work may use until it is superseded
+  std::atomic<bool> stopped{false};
+  scheduler.submit("batch", Priority::Workspace, [&](std::stop_token stop) {
+    while (!stop.stop_requested()) {
+      std::this_thread::yield();
+    }
+    stopped = true;
+  });
+  BackgroundIndexer indexer(index, scheduler, 1);
+  indexer.update_document("tests/unsaved", "int unsaved;\nunsaved = 1;\n");
+  // Waits for the document instead of for the blocked batch
+  while (index.find_references("unsaved").size() != 2) {
+    std::this_thread::yield();
+  }
+  if (stopped) {
+    return false;
+  }
+  scheduler.submit("batch", Priority::Workspace, [](std::stop_token) {});
+  scheduler.wait_idle();
+  if (!stopped) {
+    return false;
+  }
+
+  auto directory = std::filesystem::temp_directory_path() / "cpplsp_watcher";
+  std::filesystem::remove_all(directory);
+  std::filesystem::create_directories(directory / "nested");
+  FileWatcher watcher(directory);
+  if (!watcher.valid()) {
+    return true;
+  }
+  auto file = directory / "nested" / "watched";
+  for (auto i = 0; i < 3; i++) {
+    std::ofstream{file} << "int watched" << i << ";\n";
+  }
+  auto changes = watcher.wait_for_changes(std::chrono::milliseconds{50}, {});
+  if (changes.changed != std::vector<std::filesystem::path>{file}) {
+    return false;
+  }
+  indexer.apply(changes);
+  scheduler.wait_idle();
+  auto passed = index.find_references("watched2").size() == 1;
+  std::filesystem::remove_all(directory);
+  return passed;
+}
+
+auto run_utf8_validation_test() -> bool {
+  // Clean blocks of ASCII are skipped 16 bytes at a time, so put the bad
+  // bytes after one
+  std::string prefix = "int sixteen_bytes;\n";
+  auto invalid = [&](std::string tail) {
+    return Lexer("tests/utf8", prefix + tail).invalid_utf8();
+  };
+  return !invalid("auto größe = 1;\n").has_value() &&
+         invalid("a\xff") == Position{1, 1} &&
+         invalid("\xc3") == Position{1, 0} &&
+         invalid("\xc0\xaf") == Position{1, 0} &&
+         invalid("ok\xed\xa0\x80") == Position{1, 2} &&
+         invalid("\xf4\x90\x80\x80") == Position{1, 0};
+}
+
+constexpr std::array<std::string_view, 11> tests{
     "tests/identifier",
     "tests/ppnumber",
     "tests/hello_world",
     "tests/string_literal",
     "tests/user_defined_string_literal",
     "tests/two_string_literals",
-    "tests/raw_string_literal"};
+    "tests/raw_string_literal",
+    "tests/unicode_identifier",
+    "tests/keywords",
+    "tests/multiline_tokens",
+    "tests/comments"};
+
+constexpr std::array<std::string_view, 3> preprocessor_tests{
+    "tests/macro_expansion", "tests/conditional_compilation",
+    "tests/include_guard"};
+
+auto repeat(std::string_view source, int times) -> std::string {
+  std::string repeated;
+  for (auto i = 0; i < times; i++) {
+    repeated += source;
+  }
+  return repeated;
+}
+
+// Lexing in tiny chunks, so that chunks start inside tokens spanning lines,
+// gives the same tokens, brackets and comment spans as lexing in one go
+auto lexes_same_in_chunks(std::filesystem::path const &path,
+                          std::string const &source) -> bool {
+  Lexer serial(path, source);
+  serial.set_comment_mode(CommentMode::Retain);
+  auto serial_tokens = token_dump(serial);
+  auto serial_brackets = Lexer(path, source).get_all_tokens(1).brackets;
+  Lexer parallel(path, source);
+  parallel.set_comment_mode(CommentMode::Retain);
+  auto tokens = parallel.get_all_tokens(4, 16);
+  std::stringstream dump{};
+  for (auto const &token : tokens.tokens) {
+    dump << token << '\n';
+  }
+  auto same_span = [](Trivia const &a, Trivia const &b) {
+    return a.offset == b.offset && a.length == b.length;
+  };
+  return dump.str() == serial_tokens && !parallel.get_next_token() &&
+         tokens.brackets == serial_brackets &&
+         std::ranges::equal(serial.comments(), parallel.comments(), same_span);
+}
+
+// Every lexer test, and many copies of the one with tokens spanning lines
+auto run_parallel_lexing_test() -> bool {
+  for (auto test : tests) {
+    std::ifstream file{std::string{test}};
+    std::string source{std::istreambuf_iterator<char>(file),
+                       std::istreambuf_iterator<char>()};
+    if (!lexes_same_in_chunks(test, source) ||
+        (test == "tests/multiline_tokens" &&
+         !lexes_same_in_chunks(test, repeat(source, 50)))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Pairs brackets across lines and chunks, leaving mismatched ones unpaired
+auto run_bracket_matching_test() -> bool {
+  std::string source = "int f(int a[2]) {\n"
+                       "  if (a[0]) {\n"
+                       "    g(<%1%>);\n"
+                       "  }\n"
+                       "  h(]);\n"
+                       "}\n";
+  auto tokens = Lexer("tests/brackets", source).get_all_tokens(1);
+  auto pairs_with = [&](std::size_t open, std::size_t close) {
+    return tokens.matching_bracket(open) == close &&
+           tokens.matching_bracket(close) == open;
+  };
+  auto folds = tokens.folding_ranges();
+  if (!pairs_with(2, 8) || !pairs_with(5, 7) || !pairs_with(9, 36) ||
+      !pairs_with(12, 17) || !pairs_with(14, 16) || !pairs_with(18, 28) ||
+      !pairs_with(21, 25) || !pairs_with(22, 24) || !pairs_with(31, 33) ||
+      tokens.matching_bracket(32).has_value() ||
+      tokens.matching_bracket(0).has_value() ||
+      tokens.token_at(Position{2, 6}) != 22 || folds.size() != 2 ||
+      folds[0].start_line != 0 || folds[0].end_line != 5 ||
+      folds[1].start_line != 1 || folds[1].end_line != 3) {
+    return false;
+  }
+  auto repeated = "namespace {\n" + repeat(source, 50) + "}\n";
+  auto serial = Lexer("tests/brackets", repeated).get_all_tokens(1);
+  return lexes_same_in_chunks("tests/brackets", repeated) &&
+         serial.matching_bracket(1) == serial.tokens.size() - 2;
+}
+
+// Comment spans are only kept when asked for, and chunked lexing keeps the
+// spans of the chunks it reuses
+auto run_comment_trivia_test() -> bool {
+  std::string source = "/* header\n */\nint a; // one\nint/**/b;\n";
+  Lexer discard("tests/trivia", source);
+  token_dump(discard);
+  Lexer retain("tests/trivia", source);
+  retain.set_comment_mode(CommentMode::Retain);
+  token_dump(retain);
+  auto spans = retain.comments();
+  if (!discard.comments().empty() || spans.size() != 3 ||
+      source.substr(spans[0].offset, spans[0].length) != "/* header\n */" ||
+      source.substr(spans[1].offset, spans[1].length) != "// one" ||
+      source.substr(spans[2].offset, spans[2].length) != "/**/") {
+    return false;
+  }
+  return lexes_same_in_chunks("tests/trivia", repeat(source, 50));
+}
+
+// Skipping an inactive block finds each directive once, however many comments
+// lie between them, so it stays far cheaper than lexing the block
+auto run_inactive_comments_test() -> bool {
+  auto block = repeat("int a; /* c */\n", 100000);
+  auto lex = [](std::string source, std::string &spelled) {
+    auto start = std::chrono::steady_clock::now();
+    Preprocessor preprocessor("tests/inactive", std::move(source));
+    while (auto token = preprocessor.get_next_token()) {
+      if (!std::holds_alternative<NewLine>(*token)) {
+        spelled += token_spelling(*token) + ' ';
+      }
+    }
+    return std::chrono::steady_clock::now() - start;
+  };
+  std::string skipped;
+  std::string active;
+  auto skipping = lex("#if 0\n" + block + "#endif\ndone\n", skipped);
+  auto lexing = lex("#if 1\n" + block + "#endif\ndone\n", active);
+  return skipped == "done " && active.size() > block.size() / 2 &&
+         skipping * 10 < lexing;
+}
 
 int main(int argc, char **argv) {
   Args args{argc, argv};
   if (args.size() > 2) {
     if (args[1] == "create") {
       create_out(args[2]);
-    } else if (args[1] == "run") {
-      if (!run_test(args[2])) {
+    } else if (args[1] == "create_preprocessed") {
+      create_out<Preprocessor>(args[2]);
+    } else if (args[1] == "run" || args[1] == "run_preprocessed") {
+      auto passed = args[1] == "run" ? run_test(args[2])
+                                     : run_test<Preprocessor>(args[2]);
+      if (!passed) {
         std::cerr << "Test for \"" << args[2] << "\" failed!\n";
         return EXIT_FAILURE;
       } else {
@@ -80,13 +552,40 @@ int main(int argc, char **argv) {
     }
   } else {
     std::vector<std::string> failed;
-    for (auto test : tests) {
-      if (!run_test(test)) {
-        failed.push_back(std::string{test});
+    std::size_t ran = 0;
+    auto check = [&](bool passed, std::string name) {
+      ran++;
+      if (!passed) {
+        failed.push_back(std::move(name));
       }
+    };
+    for (auto test : tests) {
+      check(run_test(test), std::string{test});
+    }
+    for (auto test : preprocessor_tests) {
+      check(run_test<Preprocessor>(test), std::string{test});
+      check(run_preamble_test(test), std::string{test} + " (preamble)");
+    }
+    for (std::size_t i = 0; i < preamble_edits.size(); i++) {
+      auto [source, appended] = preamble_edits[i];
+      check(run_preamble_test("tests/preamble_edit", std::string{source},
+                              std::string{appended}),
+            "preamble edit " + std::to_string(i));
     }
+    check(run_preamble_include_test(), "preamble include lookups");
+    check(run_diagnostics_test(), "diagnostics");
+    check(run_condition_test(), "conditions");
+    check(run_inactive_regions_test(), "inactive regions");
+    check(run_index_test(), "identifier index");
+    check(run_completion_test(), "completion");
+    check(run_scheduler_test(), "scheduler");
+    check(run_utf8_validation_test(), "UTF-8 validation");
+    check(run_parallel_lexing_test(), "parallel lexing");
+    check(run_comment_trivia_test(), "comment trivia");
+    check(run_bracket_matching_test(), "bracket matching");
+    check(run_inactive_comments_test(), "comments in inactive code");
     if (!failed.empty()) {
-      std::cout << failed.size() << " of " << tests.size() << " failed:\n";
+      std::cout << failed.size() << " of " << ran << " failed:\n";
       for (auto test : failed) {
         std::cout << "\tTest for \"" << test << "\" failed!\n";
       }